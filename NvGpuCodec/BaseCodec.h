@@ -3,6 +3,7 @@
 #include <boost/atomic.hpp>
 #include <boost/assert.hpp>
 #include "NvCodecFrame.h"
+#include "ThreadPlacement.h"
 
 using namespace std;
 
@@ -12,8 +13,12 @@ protected:
 	boost::atomic_int32_t		qstrategy;	/* queue control strategy */
 
 public:
+	virtual ~BaseCodec() {}
+
 	virtual int		Init(){ return 0; };
 	virtual bool	InputStream(unsigned char* pStream, unsigned int nSize) = 0;
+	/* "pts" in 10MHz units, codecs without timestamp support ignore it */
+	virtual bool	InputStream(unsigned char* pStream, unsigned int nSize, long long pts){ return InputStream(pStream, nSize); };
 	virtual int		GetFrame(NvCodec::CuFrame &pic)							= 0;
 	virtual bool	PutFrame(NvCodec::CuFrame &pic)							= 0;
 
@@ -41,13 +46,13 @@ public:
 	typedef void(*MediaSrcDataCallback)(unsigned char *data, unsigned int len, void *p);
 
 	BaseMediaSource(std::string srcvideo, MediaSrcDataCallback msdcb, void*user, bool looplay = false, unsigned int cachesize = 1024)
-		: src(srcvideo), datacb(msdcb), cbpointer(user), decoder(NULL), loop(looplay)
+		: src(srcvideo), datacb(msdcb), cbpointer(user), decoder(NULL), loop(looplay), node(ThreadPlacement::CurrentNode())
 	{
 		/* add base class code here */
 	}
 
 	BaseMediaSource(std::string srcvideo, BaseCodec *dec, bool looplay = false, unsigned int cachesize = 1024)
-		: src(srcvideo), decoder(dec), datacb(NULL), loop(looplay)
+		: src(srcvideo), decoder(dec), datacb(NULL), loop(looplay), node(ThreadPlacement::CurrentNode())
 	{
 		/* add base class code here */
 	}
@@ -68,4 +73,5 @@ protected:
 	MediaSrcDataCallback	datacb;		/* user callback */
 	string					src;		/* video source name */
 	bool					loop;		/* loop play */
+	int						node;		/* numa node of creating thread, reader follows it */
 };
\ No newline at end of file
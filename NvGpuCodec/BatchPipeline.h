@@ -2,9 +2,18 @@
 
 #include <boost/thread.hpp>
 #include <boost/atomic.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include <queue>
+#include <string>
+#include <vector>
 #include "SmartFrame.h"
+#include "FrameReorder.h"
+#include "StageScaler.h"
+#include "ThreadPlacement.h"
+#include "StageMetrics.h"
+#include "CoroStage.h"
+#include "LoadShedder.h"
 using namespace std;
 
 /**
@@ -19,30 +28,78 @@ private:
 	class PipeQueue
 	{
 	private:
-		list<ISmartFramePtr>	frames;
+		typedef std::pair<ISmartFramePtr, unsigned long long> QueuedFrame;	/* frame and enqueue time */
+
+		list<QueuedFrame>	frames;
 		boost::recursive_mutex			mtx;
 	public:
 		PipeQueue(){}
 		~PipeQueue(){ 
-			cout << "PipeQueue destructing~" << endl;
-			frames.clear();
-			mtx.destroy();
+			Clear();
 		}
 		void Push(ISmartFramePtr frame) { 
 			boost::lock_guard<boost::recursive_mutex> lock(mtx);
-			frames.push_back(frame); 
+			frames.push_back(QueuedFrame(frame, MetricsClock())); 
 		}
-		ISmartFramePtr Pop() { 
+		ISmartFramePtr Pop(unsigned long long *enqueued = NULL) { 
 
 			boost::lock_guard<boost::recursive_mutex> lock(mtx);
 			if (frames.size())
 			{
-				ISmartFramePtr p = frames.front();
+				ISmartFramePtr p = frames.front().first;
+				if (enqueued) *enqueued = frames.front().second;
 				frames.pop_front();
 				return p;
 			}
 			return NULL;
 		}
+		unsigned int Size() {
+			boost::lock_guard<boost::recursive_mutex> lock(mtx);
+			return frames.size();
+		}
+		unsigned int Clear() {
+			boost::lock_guard<boost::recursive_mutex> lock(mtx);
+			unsigned int n = frames.size();
+			frames.clear();
+			return n;
+		}
+		/**
+		 * Description: remove "n" frames, oldest first, or lowest priority stream first if
+						"byprio" is given. last frames are kept. removed frames go to "shed".
+		 */
+		void Shed(unsigned int n, LoadShedder *byprio, std::vector<ISmartFramePtr> &shed) {
+			boost::lock_guard<boost::recursive_mutex> lock(mtx);
+			while (n)
+			{
+				list<QueuedFrame>::iterator victim = frames.end();
+				int lowest = 0;
+				for (list<QueuedFrame>::iterator it = frames.begin(); it != frames.end(); it++)
+				{
+					if (it->first->LastFrame())
+						continue;
+
+					if (!byprio)
+					{
+						victim = it;
+						break;
+					}
+
+					int prio = byprio->Priority(it->first->Tid());
+					if ((victim == frames.end()) || (prio < lowest))
+					{
+						victim = it;
+						lowest = prio;
+					}
+				}
+
+				if (victim == frames.end())
+					break;
+
+				shed.push_back(victim->first);
+				frames.erase(victim);
+				n--;
+			}
+		}
 	};
 
 	unsigned int					procedure_count;
@@ -52,33 +109,356 @@ private:
 														workers consume frames in there PipeQueue, 
 														processed frames push to next procedure queue */
 	boost::atomic_bool				eop;			/* end of procedure */
+	boost::atomic_bool				intake;			/* accepting new batches */
+	boost::atomic_uint32_t			busy;			/* frames taken out of queue and not forwarded yet */
+	StageMetrics *					metrics;		/* latency and throughput of each procedure */
 	char *							host_nv12;	/* host nv12 buffer */
+	std::vector<std::string>		holdname;		/* residency holder names, queue and procedure of each index */
+
+	/**
+	 * Description: optional reorder on each procedure output, frames of the same
+					stream leave a multi-worker procedure in FrameNo order
+	 */
+	struct ReorderHop
+	{
+		BatchPipeline *		pipe;
+		unsigned int		pipeindex;
+	};
+	FrameReorder **					reorder;		/* reorder of each procedure, NULL if unordered */
+	ReorderHop *					reorderhop;		/* reorder callback pointer of each procedure */
+
+	/**
+	 * Description: optional worker autoscaling, "procedure_threads" workers are created for
+					each procedure, workers beyond the active count are parked
+	 */
+	StageScaler *					scaler;			/* worker controller, NULL if fixed */
+	boost::thread *					scalethread;	/* controller thread */
+	boost::mutex					parkmtx;		/* lock for parked workers */
+	boost::condition_variable		parkcv;			/* wake up parked workers */
+
+	/**
+	 * Description: optional load shedding, frames are skipped by stages when they can not
+					meet their deadline, entry queue overflow sheds frames by policy order
+	 */
+	LoadShedder *					shedder;		/* NULL if never shed */
+
+#ifdef PIPELINE_COROUTINE
+	/**
+	 * Description: optional coroutine procedures, workers of such a procedure only pop frames
+					and start coroutines on the shared scheduler
+	 */
+	struct CoroHop
+	{
+		CoroRoutine				routine;		/* NULL for thread procedure */
+		void *					user;			/* routine pointer */
+		unsigned int			maxinflight;	/* suspended frames bound */
+		boost::atomic_uint32_t	inflight;		/* suspended frames */
+
+		CoroHop() : routine(NULL), user(NULL), maxinflight(0), inflight(0) {}
+	};
+	CoroHop *						coro;			/* coroutine setting of each procedure */
+	CoroScheduler *					corosched;		/* scheduler shared by coroutine procedures */
+	boost::mutex					coromtx;		/* lock for scheduler creation */
+#endif
 
 public:
 	/**
 	 * Description: init with "procedure" size of procedures, each procedure has "worker" threads.
+					if "ordered" is set, output of each procedure is reordered per stream, which
+					matters for multi-worker and coroutine procedures. gaps are waited for at
+					most "reorder_timeout" ms.
 	 */
-	BatchPipeline(unsigned int procedure = 2, unsigned int worker = 1)
-		:procedure_count(procedure), procedure_threads(worker), eop(false), host_nv12(NULL)
+	BatchPipeline(unsigned int procedure = 2, unsigned int worker = 1,
+		bool ordered = false, unsigned int reorder_window = 16, unsigned int reorder_timeout = 100)
+		:procedure_count(procedure), procedure_threads(worker), eop(false), intake(true), busy(0), metrics(NULL), host_nv12(NULL), reorder(NULL), reorderhop(NULL)
+		, scaler(NULL), scalethread(NULL), shedder(NULL)
 	{
-		BOOST_ASSERT(procedure > 0);
-		BOOST_ASSERT(worker > 0);
+		Init(ordered, reorder_window, reorder_timeout);
+	}
+
+	/**
+	 * Description: init with "procedure" size of procedures, active workers of each procedure
+					are scaled in [policy.minworker, policy.maxworker] by queue depth.
+	 */
+	BatchPipeline(unsigned int procedure, const ScalePolicy &policy,
+		bool ordered = false, unsigned int reorder_window = 16, unsigned int reorder_timeout = 100)
+		:procedure_count(procedure), procedure_threads(policy.maxworker), eop(false), intake(true), busy(0), metrics(NULL), host_nv12(NULL), reorder(NULL), reorderhop(NULL)
+		, scaler(NULL), scalethread(NULL), shedder(NULL)
+	{
+		scaler = new StageScaler(procedure_count, policy);
+
+		Init(ordered, reorder_window, reorder_timeout);
+
+		scalethread = new boost::thread(boost::bind(&BatchPipeline::ScaleRoutine, this));
+	}
+
+	~BatchPipeline()
+	{
+		Stop();
+
+		if (pipequeue)
+		{
+			/* allocated as array, must be released as array */
+			delete[] pipequeue;
+			pipequeue = NULL;
+		}
+
+#ifdef PIPELINE_COROUTINE
+		if (coro)
+		{
+			delete[] coro;
+			coro = NULL;
+		}
+#endif
+
+		if (reorder)
+		{
+			for (int i = 0; i < procedure_count; i++)
+			{
+				delete reorder[i];
+				reorder[i] = NULL;
+			}
+
+			delete[] reorder;
+			reorder = NULL;
+
+			delete[] reorderhop;
+			reorderhop = NULL;
+		}
+
+		if (metrics)
+		{
+			delete[] metrics;
+			metrics = NULL;
+		}
+
+		if (scaler)
+		{
+			delete scaler;
+			scaler = NULL;
+		}
+
+		if (shedder)
+		{
+			delete shedder;
+			shedder = NULL;
+		}
+
+		if (host_nv12)
+		{
+			delete[] host_nv12;
+			host_nv12 = NULL;
+		}
+	}
+
+	/**
+	 * Description: graceful shutdown. stop accepting batches, wait at most "timeout" ms for
+					queued and in-flight frames to leave the last procedure, frames waiting
+					in reorder for a gap are flushed. then workers are stopped and frames
+					still queued are released. return true if every frame left in time.
+	 */
+	bool Drain(unsigned int timeout)
+	{
+		intake = false;
+
+		boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(timeout);
+		bool drained = false;
+
+		while (!drained)
+		{
+			if (Idle())
+			{
+				/**
+				 * Description: no more input, gaps in reorder will never be filled
+				 */
+				bool flushed = false;
+				for (int i = 0; reorder && (i < procedure_count); i++)
+				{
+					if (reorder[i]->Pending())
+					{
+						reorder[i]->Flush();
+						flushed = true;
+					}
+				}
+
+				drained = !flushed && Idle();
+				continue;
+			}
+
+			if (boost::chrono::steady_clock::now() >= deadline)
+				break;
+
+			boost::this_thread::sleep(boost::posix_time::millisec(1));
+		}
+
+		Stop();
+
 		/**
-		 * Description: init for device buffer copy
+		 * Description: release frames which did not make it
 		 */
-		pipequeue = new PipeQueue[procedure_count];
-
-		pipeline = new boost::thread *[procedure_count * procedure_threads];
+		unsigned int abandoned = 0;
 		for (int i = 0; i < procedure_count; i++)
-			for (int j = 0; j < procedure_threads; j++)
-				pipeline[procedure_threads * i + j] = new boost::thread(boost::bind(&BatchPipeline::PipelineRoutine, this, i));
+		{
+			abandoned += pipequeue[i].Clear();
+			if (reorder)
+			{
+				abandoned += reorder[i]->Pending();
+				reorder[i]->Clear();
+			}
+		}
+
+		if (!drained)
+		{
+			std::cout << "[warning] pipeline drain timeout, " << abandoned << " queued and " << busy
+				<< " in-flight frames abandoned. err(" << timeout << ")" << std::endl;
+		}
+
+		return drained;
 	}
 
-	~BatchPipeline()
+	/**
+	 * Description: latency histograms and counters of procedure "pipeindex", wait is the time
+					spent in procedure queue, service is the procedure processing time
+	 */
+	StageSnapshot Metrics(unsigned int pipeindex)
 	{
-		if (pipeline)
+		BOOST_ASSERT(pipeindex < procedure_count);
+
+		return metrics[pipeindex].Snapshot();
+	}
+
+	/**
+	 * Description: scaling metrics of procedure "pipeindex", autoscaling only
+	 */
+	ScaleMetrics ScaleStat(unsigned int pipeindex)
+	{
+		BOOST_ASSERT(scaler);
+		BOOST_ASSERT(pipeindex < procedure_count);
+
+		return scaler->Metrics(pipeindex);
+	}
+
+	/**
+	 * Description: enable load shedding, call before feeding frames
+	 */
+	void SetShedPolicy(const ShedPolicy &policy)
+	{
+		BOOST_ASSERT(!shedder);
+
+		shedder = new LoadShedder(procedure_count, policy);
+	}
+
+	/**
+	 * Description: priority of stream "tid" for SOLowPriorityFirst, bigger is more important
+	 */
+	void SetStreamPriority(unsigned int tid, int priority)
+	{
+		BOOST_ASSERT(shedder);
+
+		shedder->Priority(tid, priority);
+	}
+
+	/**
+	 * Description: frames shed for "reason", load shedding only
+	 */
+	unsigned long long ShedStat(ShedReason reason)
+	{
+		BOOST_ASSERT(shedder);
+		BOOST_ASSERT(reason < SRMax);
+
+		return shedder->Count(reason);
+	}
+
+#ifdef PIPELINE_COROUTINE
+	/**
+	 * Description: turn procedure "pipeindex" into a coroutine procedure, call before feeding
+					frames. at most "maxinflight" frames of the procedure are suspended at the
+					same time, the scheduler is created with "schedthreads" threads on first call.
+	 */
+	void SetCoroStage(unsigned int pipeindex, CoroRoutine routine, void *user = 0,
+		unsigned int maxinflight = 1024, unsigned int schedthreads = 2)
+	{
+		BOOST_ASSERT(pipeindex < procedure_count);
+		BOOST_ASSERT(routine);
+
+		{
+			boost::lock_guard<boost::mutex> lock(coromtx);
+			if (!corosched)
+				corosched = new CoroScheduler(schedthreads);
+		}
+
+		coro[pipeindex].user		= user;
+		coro[pipeindex].maxinflight	= max(maxinflight, 1u);
+		coro[pipeindex].routine		= routine;
+	}
+#endif
+
+	bool EatBatch(ISmartFramePtr *batch, unsigned int len)
+	{
+		if (!intake)
+		{
+			/* draining, frames are released by caller */
+			return false;
+		}
+
+		/**
+		 * Description: push to pipeline entry queue
+		 */
+		for (int i = 0; i < len; i++)
+		{
+			if (shedder)
+				shedder->Stamp(batch[i]);
+
+			batch[i]->Hold(holdname[0].c_str());
+			pipequeue[0].Push(batch[i]);
+		}
+
+		metrics[0].Batches();
+
+		if (shedder && shedder->Policy().maxqueue)
 		{
+			unsigned int depth = pipequeue[0].Size();
+			if (depth > shedder->Policy().maxqueue)
+			{
+				/**
+				 * Description: entry queue overflow, shed by policy order
+				 */
+				bool byprio = (SOLowPriorityFirst == shedder->Policy().order);
+				std::vector<ISmartFramePtr> shed;
+				pipequeue[0].Shed(depth - shedder->Policy().maxqueue, byprio ? shedder : NULL, shed);
+
+				for (int i = 0; i < shed.size(); i++)
+					Drop(0, shed[i], byprio ? SRPriority : SROldest);
+			}
+		}
+
+		return true;
+	}
+
+private:
+	/**
+	 * Description: stop and join all threads, safe to call more than once
+	 */
+	void Stop()
+	{
+		{
+			/* waiters on parkcv check eop under parkmtx */
+			boost::lock_guard<boost::mutex> lock(parkmtx);
 			eop = true;
+		}
+		parkcv.notify_all();
+
+		if (scalethread)
+		{
+			if (scalethread->joinable())
+				scalethread->join();
+
+			delete scalethread;
+			scalethread = NULL;
+		}
+
+		if (pipeline)
+		{
 			for (int i = 0; i<(procedure_count * procedure_threads); i++)
 			{
 				if (pipeline[i] && pipeline[i]->joinable())
@@ -89,65 +469,275 @@ public:
 				}
 			}
 
-			/* [TODO] delete pipequeue will cause a DEBUG ASSERTION FAILED. unsolved.
-			if (pipequeue)
-			{
-				delete pipequeue;
-				pipequeue = NULL;
-			}
-			*/
-
-			delete pipeline;
+			delete[] pipeline;
 			pipeline = NULL;
 		}
 
-		if (host_nv12)
+#ifdef PIPELINE_COROUTINE
+		if (corosched)
 		{
-			delete host_nv12;
-			host_nv12 = NULL;
+			/* no coroutine is started any more, stop scheduler before its targets go away */
+			delete corosched;
+			corosched = NULL;
 		}
+#endif
 	}
 
-	void EatBatch(ISmartFramePtr *batch, unsigned int len)
+	/**
+	 * Description: no frame queued or being processed
+	 */
+	inline bool Idle()
 	{
+		if (busy) return false;
+
+		for (int i = 0; i < procedure_count; i++)
+			if (pipequeue[i].Size()) return false;
+
+		return !busy;
+	}
+
+	void Init(bool ordered, unsigned int reorder_window, unsigned int reorder_timeout)
+	{
+		BOOST_ASSERT(procedure_count > 0);
+		BOOST_ASSERT(procedure_threads > 0);
 		/**
-		 * Description: push to pipeline entry queue
+		 * Description: init for device buffer copy
 		 */
-		for (int i = 0; i < len; i++)
-			pipequeue[0].Push(batch[i]);
+		pipequeue = new PipeQueue[procedure_count];
+		metrics = new StageMetrics[procedure_count];
+
+		for (int i = 0; i < procedure_count; i++)
+		{
+			holdname.push_back("pipeline queue " + boost::lexical_cast<std::string>(i));
+			holdname.push_back("pipeline procedure " + boost::lexical_cast<std::string>(i));
+		}
+
+#ifdef PIPELINE_COROUTINE
+		coro = new CoroHop[procedure_count];
+		corosched = NULL;
+#endif
+
+		if (ordered)
+		{
+			/**
+			 * Description: output of single worker procedure is already in order, reorder passes it through
+			 */
+			reorder = new FrameReorder *[procedure_count];
+			reorderhop = new ReorderHop[procedure_count];
+			for (int i = 0; i < procedure_count; i++)
+			{
+				reorderhop[i].pipe = this;
+				reorderhop[i].pipeindex = i;
+				reorder[i] = new FrameReorder(OnReorder, &reorderhop[i], reorder_window, reorder_timeout);
+			}
+		}
+
+		pipeline = new boost::thread *[procedure_count * procedure_threads];
+		for (int i = 0; i < procedure_count; i++)
+			for (int j = 0; j < procedure_threads; j++)
+				pipeline[procedure_threads * i + j] = new boost::thread(boost::bind(&BatchPipeline::PipelineRoutine, this, i, j));
 	}
 
-private:
-	void PipelineRoutine(unsigned int pipeindex)
+	void PipelineRoutine(unsigned int pipeindex, unsigned int workerindex)
 	{
+		/* pinned only if procedure has a core list */
+		ThreadPlacement::Instance().Pin(PSPipeline + pipeindex, -1);
+
 		while (!eop)
 		{
-			ISmartFramePtr frame(pipequeue[pipeindex].Pop());
+			if (scaler && (workerindex >= scaler->Active(pipeindex)))
+			{
+				/**
+				 * Description: parked by controller
+				 */
+				boost::unique_lock<boost::mutex> lock(parkmtx);
+				parkcv.wait_for(lock, boost::chrono::milliseconds(10));
+				continue;
+			}
+
+			if (reorder)
+			{
+				/**
+				 * Description: release frames waiting for a timed-out gap
+				 */
+				reorder[pipeindex]->Expire();
+			}
+
+			unsigned long long enqueued = 0;
+#ifdef PIPELINE_COROUTINE
+			if (coro[pipeindex].routine && (coro[pipeindex].inflight >= coro[pipeindex].maxinflight))
+			{
+				/**
+				 * Description: too many suspended frames, wait for some to finish
+				 */
+				boost::this_thread::sleep(boost::posix_time::millisec(1));
+				continue;
+			}
+#endif
+
+			/* count before pop, drain never sees a frame in neither queue nor busy */
+			busy++;
+			ISmartFramePtr frame(pipequeue[pipeindex].Pop(&enqueued));
 			if (frame == NULL)
 			{
+				busy--;
 				boost::this_thread::sleep(boost::posix_time::millisec(10));
 				continue;
 			}
 
+			unsigned long long start = MetricsClock();
+			metrics[pipeindex].Wait(start - enqueued);
+			frame->Hold(holdname[pipeindex * 2 + 1].c_str());
+
+			if (shedder && !shedder->Admit(pipeindex, frame))
+			{
+				/* deadline can not be met */
+				Drop(pipeindex, frame, SRDeadline);
+				busy--;
+				continue;
+			}
+
+#ifdef PIPELINE_COROUTINE
+			if (coro[pipeindex].routine)
+			{
+				StartCoro(pipeindex, frame, start);
+				continue;
+			}
+#endif
+
 			/**
 			 * Description: do something
 			 */
 			boost::this_thread::sleep(boost::posix_time::millisec(10));
 
-			if ((pipeindex + 1) != procedure_count)
+			Served(pipeindex, MetricsClock() - start);
+
+			if (reorder)
+			{
+				reorder[pipeindex]->Push(frame);
+			}
+			else
+			{
+				Forward(pipeindex, frame);
+			}
+
+			busy--;
+		}
+	}
+
+#ifdef PIPELINE_COROUTINE
+	void StartCoro(unsigned int pipeindex, ISmartFramePtr frame, unsigned long long start)
+	{
+		CoroHop &hop = coro[pipeindex];
+		hop.inflight++;
+
+		hop.routine(frame, *corosched, hop.user).Start(*corosched, [this, pipeindex, frame, start]() mutable {
+			/**
+			 * Description: coroutine finished on scheduler thread, forward like a thread procedure
+			 */
+			Served(pipeindex, MetricsClock() - start);
+
+			if (reorder)
+			{
+				reorder[pipeindex]->Push(frame);
+			}
+			else
+			{
+				Forward(pipeindex, frame);
+			}
+
+			coro[pipeindex].inflight--;
+			busy--;
+		});
+	}
+#endif
+
+	void ScaleRoutine()
+	{
+		const ScalePolicy &policy = scaler->Policy();
+		std::vector<LatencySnapshot> last(procedure_count);
+
+		while (!eop)
+		{
 			{
 				/**
-				 * Description: push to next procedure queue
+				 * Description: tick every interval, Stop wakes it up
 				 */
-				pipequeue[pipeindex + 1].Push(frame);
+				boost::unique_lock<boost::mutex> lock(parkmtx);
+				boost::chrono::steady_clock::time_point until = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(policy.interval);
+				while (!eop && (parkcv.wait_until(lock, until) == boost::cv_status::no_timeout));
 			}
-			else
+
+			if (eop)
+				break;
+
+			bool changed = false;
+			for (int i = 0; i < procedure_count; i++)
 			{
 				/**
-				 * Description: last procedure
+				 * Description: mean service time of frames served during this tick
 				 */
-				std::cout << "frame " << frame->FrameNo() << " released~" << std::endl;
+				LatencySnapshot service = metrics[i].Snapshot().service;
+				unsigned int mean = (unsigned int)service.Since(last[i]).Mean();
+				last[i] = service;
+
+				unsigned int active = scaler->Active(i);
+				changed |= (scaler->Tick(i, pipequeue[i].Size(), mean) != active);
 			}
+
+			if (changed)
+			{
+				/**
+				 * Description: let newly activated workers run
+				 */
+				parkcv.notify_all();
+			}
+		}
+	}
+
+	inline void Served(unsigned int pipeindex, unsigned long long us)
+	{
+		metrics[pipeindex].Service(us);
+		metrics[pipeindex].Frames();
+
+		if (shedder)
+			shedder->Served(pipeindex, us);
+	}
+
+	/**
+	 * Description: a frame shed before procedure "pipeindex", counted only, the reorder
+					of that procedure is told not to wait for it
+	 */
+	inline void Drop(unsigned int pipeindex, ISmartFramePtr &frame, ShedReason reason)
+	{
+		shedder->Shed(reason);
+
+		if (reorder)
+			reorder[pipeindex]->Discard(frame);
+	}
+
+	static void OnReorder(ISmartFramePtr frame, void *user)
+	{
+		ReorderHop *hop = (ReorderHop*)user;
+		hop->pipe->Forward(hop->pipeindex, frame);
+	}
+
+	inline void Forward(unsigned int pipeindex, ISmartFramePtr &frame)
+	{
+		if ((pipeindex + 1) != procedure_count)
+		{
+			/**
+			 * Description: push to next procedure queue
+			 */
+			frame->Hold(holdname[(pipeindex + 1) * 2].c_str());
+			pipequeue[pipeindex + 1].Push(frame);
+		}
+		else
+		{
+			/**
+			 * Description: last procedure
+			 */
+			std::cout << "frame " << frame->FrameNo() << " released~" << std::endl;
 		}
 	}
 };
\ No newline at end of file
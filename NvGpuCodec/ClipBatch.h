@@ -0,0 +1,242 @@
+#pragma once
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/assert.hpp>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <map>
+#include "SmartFrame.h"
+#include "StageMetrics.h"
+
+/**
+ * Description: sliding-window clip batching. each stream keeps a window of its latest
+				"length" frames, a clip is taken every "stride" frames once the window is
+				full. clips share frame references, overlapping clips copy nothing. a batch
+				is emitted when every active stream has a clip ready, so batches are packed
+				[streams x length], or when the oldest ready clip waited "timeout" ms for
+				lagging streams. the timeout is polled by an expiry thread, clips of
+				stalled streams go out without waiting for another frame. each stream pins
+				at most Frames() frames, window and ready clip.
+ */
+class ClipBatcher
+{
+public:
+	ClipBatcher(ClipBatchRoutine routine, void *invk, unsigned int length, unsigned int stride, unsigned int timeout = 100)
+		: cliproutine(routine), invoker(invk), cliplen(length), clipstride(std::max(stride, 1u)), waitus(timeout * 1000ULL), ready(0), stop(false), expirer(NULL)
+	{
+		BOOST_ASSERT(routine);
+		BOOST_ASSERT(length > 0);
+
+		expirer = new boost::thread(boost::bind(&ClipBatcher::ExpireRoutine, this));
+	}
+
+	~ClipBatcher()
+	{
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			stop = true;
+		}
+		expirecv.notify_all();
+
+		if (expirer)
+		{
+			expirer->join();
+			delete expirer;
+			expirer = NULL;
+		}
+
+		Clear();
+	}
+
+	/**
+	 * Description: frames a stream pins at most, its window and its ready clip
+	 */
+	inline unsigned int Frames()
+	{
+		return cliplen * 2;
+	}
+
+	/**
+	 * Description: feed a decoded frame of its stream. last frame ends the stream, its
+					partial window is dropped and its ready clip still goes out.
+	 */
+	void Add(ISmartFramePtr frame)
+	{
+		std::vector<ISmartFramePtr> batch;
+		std::vector<ISmartFramePtr> early;
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+
+			ClipStream &s = streams[frame->Tid()];
+
+			if (frame->LastFrame())
+			{
+				s.window.clear();
+				s.done = true;
+			}
+			else
+			{
+				s.window.push_back(frame);
+				if (s.window.size() > cliplen)
+					s.window.pop_front();
+				s.since++;
+
+				if ((s.window.size() == cliplen) && (s.since >= clipstride))
+				{
+					if (s.ready)
+					{
+						/**
+						 * Description: stream got ahead of the others, send what is ready first
+						 */
+						Take(early);
+					}
+
+					s.clip.assign(s.window.begin(), s.window.end());
+					s.clock	= MetricsClock();
+					s.since	= 0;
+					s.ready	= true;
+					ready++;
+				}
+			}
+
+			if (Due())
+				Take(batch);
+		}
+
+		Emit(early);
+		Emit(batch);
+	}
+
+	/**
+	 * Description: emit ready clips without waiting for other streams, return clips emitted
+	 */
+	unsigned int Flush()
+	{
+		std::vector<ISmartFramePtr> batch;
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			Take(batch);
+		}
+
+		Emit(batch);
+		return batch.size() / cliplen;
+	}
+
+	/**
+	 * Description: release windows and ready clips without emitting
+	 */
+	void Clear()
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		streams.clear();
+		ready = 0;
+	}
+
+private:
+	struct ClipStream
+	{
+		std::deque<ISmartFramePtr>	window;		/* latest frames, at most "cliplen" */
+		std::vector<ISmartFramePtr>	clip;		/* ready clip */
+		unsigned int				since;		/* frames since last clip */
+		unsigned long long			clock;		/* when clip got ready, MetricsClock */
+		bool						ready;		/* clip waits for emission */
+		bool						done;		/* last frame seen */
+
+		ClipStream() : since(0), clock(0), ready(false), done(false) {}
+	};
+
+	/**
+	 * Description: every active stream is ready, or a ready clip waited too long
+	 */
+	inline bool Due()
+	{
+		if (!ready)
+			return false;
+
+		unsigned int active = 0;
+		unsigned long long oldest = 0;
+		for (std::map<unsigned int, ClipStream>::iterator it = streams.begin(); it != streams.end(); it++)
+		{
+			if (!it->second.done || it->second.ready)
+				active++;
+
+			if (it->second.ready && (!oldest || (it->second.clock < oldest)))
+				oldest = it->second.clock;
+		}
+
+		return (ready >= active) || ((MetricsClock() - oldest) >= waitus);
+	}
+
+	/**
+	 * Description: move ready clips to "batch" in stream order, forget finished streams
+	 */
+	inline void Take(std::vector<ISmartFramePtr> &batch)
+	{
+		for (std::map<unsigned int, ClipStream>::iterator it = streams.begin(); it != streams.end();)
+		{
+			ClipStream &s = it->second;
+			if (s.ready)
+			{
+				batch.insert(batch.end(), s.clip.begin(), s.clip.end());
+				s.clip.clear();
+				s.ready = false;
+			}
+
+			if (s.done)
+				streams.erase(it++);
+			else
+				it++;
+		}
+
+		ready = 0;
+	}
+
+	inline void Emit(std::vector<ISmartFramePtr> &batch)
+	{
+		if (batch.size())
+			cliproutine(&batch[0], batch.size() / cliplen, cliplen, invoker);
+	}
+
+	/**
+	 * Description: emit clips which waited "waitus" for lagging streams. a stream blocked
+					on buffers held by ready clips gets no frame to Add, so it is not
+					evaluated on arrival only.
+	 */
+	void ExpireRoutine()
+	{
+		boost::chrono::microseconds period(std::max(waitus / 4, 1000ULL));
+
+		boost::unique_lock<boost::mutex> lock(mtx);
+		while (!stop)
+		{
+			expirecv.wait_for(lock, period);
+			if (stop || !Due())
+				continue;
+
+			std::vector<ISmartFramePtr> batch;
+			Take(batch);
+
+			lock.unlock();
+			Emit(batch);
+			batch.clear();
+			lock.lock();
+		}
+	}
+
+private:
+	ClipBatchRoutine						cliproutine;	/* clip batch callback */
+	void *									invoker;		/* callback pointer */
+	unsigned int							cliplen;		/* frames per clip */
+	unsigned int							clipstride;		/* frames between clip starts */
+	unsigned long long						waitus;			/* wait bound for lagging streams, microsecond */
+	unsigned int							ready;			/* streams with a ready clip */
+	boost::mutex							mtx;			/* lock for streams */
+	std::map<unsigned int, ClipStream>		streams;		/* tid to stream window */
+	bool									stop;			/* expiry thread quit, under mtx */
+	boost::condition_variable				expirecv;		/* wakes expiry thread on stop */
+	boost::thread *							expirer;		/* expiry thread */
+};
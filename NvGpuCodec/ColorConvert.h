@@ -0,0 +1,191 @@
+#pragma once
+
+#include <boost/assert.hpp>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "SmartFrame.h"
+
+/**
+ * Description: cpu conversion of host nv12 to the color spaces in PCC_ColorSpace, with
+				nearest neighbour resize. yuv to rgb uses bt.601 limited range integer math.
+ */
+class ColorConvert
+{
+public:
+	/**
+	 * Description: bytes needed by a "w" x "h" image of color space "cs"
+	 */
+	static unsigned int Size(PCC_ColorSpace cs, unsigned int w, unsigned int h)
+	{
+		unsigned int cw = (w + 1) >> 1, ch = (h + 1) >> 1;
+
+		switch (cs)
+		{
+		case PCC_CS_GRAY:		return w * h;
+		case PCC_CS_RGB:
+		case PCC_CS_BGR:
+		case PCC_CS_RGBP:
+		case PCC_CS_BGRP:		return w * h * 3;
+		case PCC_CS_YUV420P:	return w * h + cw * ch * 2;
+		case PCC_CS_YUV422P:	return w * h + cw * h * 2;
+		default:				return 0;
+		}
+	}
+
+	/**
+	 * Description: convert nv12("y" plane and interleaved "uv" plane of "sw" x "sh" with "sstep")
+					to "cs" resized to "dw" x "dh" into "dst" of at least Size bytes, "out" is
+					filled with planes and steps of the result.
+	 */
+	static bool FromNv12(const unsigned char *y, const unsigned char *uv, unsigned int sw, unsigned int sh, unsigned int sstep,
+		PCC_ColorSpace cs, unsigned int dw, unsigned int dh, unsigned char *dst, PCC_Frame &out)
+	{
+		BOOST_ASSERT(y && uv && dst);
+
+		if (!sw || !sh || !dw || !dh || !Size(cs, dw, dh))
+			return false;
+
+		memset(&out, 0, sizeof(out));
+		out.width		= dw;
+		out.height		= dh;
+		out.colorSpace	= cs;
+
+		/**
+		 * Description: source column of each destination column
+		 */
+		std::vector<unsigned int> xmap(dw);
+		for (unsigned int x = 0; x < dw; x++)
+			xmap[x] = (unsigned int)(((unsigned long long)x * sw) / dw);
+
+		unsigned int cw = (dw + 1) >> 1, ch = (dh + 1) >> 1;
+
+		switch (cs)
+		{
+		case PCC_CS_GRAY:
+			SetPlanes(out, dst, dw, dh, 1, 1);
+			for (unsigned int r = 0; r < dh; r++)
+			{
+				const unsigned char *sy = y + SrcRow(r, sh, dh) * sstep;
+				unsigned char *d = dst + r * dw;
+				for (unsigned int x = 0; x < dw; x++)
+					d[x] = sy[xmap[x]];
+			}
+			return true;
+
+		case PCC_CS_RGB:
+		case PCC_CS_BGR:
+			out.imageData[0]	= dst;
+			out.step[0]			= dw * 3;
+			for (unsigned int r = 0; r < dh; r++)
+			{
+				unsigned int sr = SrcRow(r, sh, dh);
+				const unsigned char *sy = y + sr * sstep;
+				const unsigned char *suv = uv + (sr >> 1) * sstep;
+				unsigned char *d = dst + r * dw * 3;
+				for (unsigned int x = 0; x < dw; x++, d += 3)
+				{
+					unsigned int sx = xmap[x];
+					Pixel(sy[sx], suv[sx & ~1u], suv[sx | 1u], d, (cs == PCC_CS_RGB) ? 0 : 2, 1, (cs == PCC_CS_RGB) ? 2 : 0);
+				}
+			}
+			return true;
+
+		case PCC_CS_RGBP:
+		case PCC_CS_BGRP:
+			SetPlanes(out, dst, dw, dh, 3, 1);
+			for (unsigned int r = 0; r < dh; r++)
+			{
+				unsigned int sr = SrcRow(r, sh, dh);
+				const unsigned char *sy = y + sr * sstep;
+				const unsigned char *suv = uv + (sr >> 1) * sstep;
+				unsigned char *p0 = (unsigned char *)out.imageData[0] + r * dw;
+				unsigned char *p1 = (unsigned char *)out.imageData[1] + r * dw;
+				unsigned char *p2 = (unsigned char *)out.imageData[2] + r * dw;
+				for (unsigned int x = 0; x < dw; x++)
+				{
+					unsigned char rgb[3];
+					unsigned int sx = xmap[x];
+					Pixel(sy[sx], suv[sx & ~1u], suv[sx | 1u], rgb, 0, 1, 2);
+					p0[x] = rgb[(cs == PCC_CS_RGBP) ? 0 : 2];
+					p1[x] = rgb[1];
+					p2[x] = rgb[(cs == PCC_CS_RGBP) ? 2 : 0];
+				}
+			}
+			return true;
+
+		case PCC_CS_YUV420P:
+		case PCC_CS_YUV422P:
+		{
+			unsigned int crows = (cs == PCC_CS_YUV420P) ? ch : dh;
+
+			out.imageData[0]	= dst;
+			out.imageData[1]	= dst + dw * dh;
+			out.imageData[2]	= dst + dw * dh + cw * crows;
+			out.step[0]			= dw;
+			out.step[1]			= out.step[2] = cw;
+
+			for (unsigned int r = 0; r < dh; r++)
+			{
+				const unsigned char *sy = y + SrcRow(r, sh, dh) * sstep;
+				unsigned char *d = dst + r * dw;
+				for (unsigned int x = 0; x < dw; x++)
+					d[x] = sy[xmap[x]];
+			}
+
+			/**
+			 * Description: chroma sampled at the source position of each destination chroma sample
+			 */
+			for (unsigned int r = 0; r < crows; r++)
+			{
+				unsigned int dr = (cs == PCC_CS_YUV420P) ? std::min(r << 1, dh - 1) : r;
+				const unsigned char *suv = uv + (SrcRow(dr, sh, dh) >> 1) * sstep;
+				unsigned char *u = (unsigned char *)out.imageData[1] + r * cw;
+				unsigned char *v = (unsigned char *)out.imageData[2] + r * cw;
+				for (unsigned int x = 0; x < cw; x++)
+				{
+					unsigned int sx = xmap[std::min(x << 1, dw - 1)] & ~1u;
+					u[x] = suv[sx];
+					v[x] = suv[sx + 1];
+				}
+			}
+			return true;
+		}
+
+		default:
+			return false;
+		}
+	}
+
+private:
+	static inline unsigned int SrcRow(unsigned int r, unsigned int sh, unsigned int dh)
+	{
+		return (unsigned int)(((unsigned long long)r * sh) / dh);
+	}
+
+	static inline void SetPlanes(PCC_Frame &out, unsigned char *dst, unsigned int w, unsigned int h, unsigned int planes, unsigned int bpp)
+	{
+		for (unsigned int i = 0; i < planes; i++)
+		{
+			out.imageData[i]	= dst + i * w * h * bpp;
+			out.step[i]			= w * bpp;
+		}
+	}
+
+	static inline unsigned char Clip(int v)
+	{
+		return (unsigned char)((v < 0) ? 0 : ((v > 255) ? 255 : v));
+	}
+
+	/**
+	 * Description: one bt.601 pixel, r/g/b written to d[ri], d[gi], d[bi]
+	 */
+	static inline void Pixel(int Y, int U, int V, unsigned char *d, int ri, int gi, int bi)
+	{
+		int c = 298 * (Y - 16), du = U - 128, dv = V - 128;
+
+		d[ri] = Clip((c + 409 * dv + 128) >> 8);
+		d[gi] = Clip((c - 100 * du - 208 * dv + 128) >> 8);
+		d[bi] = Clip((c + 516 * du + 128) >> 8);
+	}
+};
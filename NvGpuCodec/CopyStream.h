@@ -0,0 +1,134 @@
+#pragma once
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <vector>
+#include "cuda_runtime_api.h"
+#include "DedicatedPool.h"
+
+/**
+ * Description: cuda stream a codec issues its frame copies on, with a pool of completion
+				events handed out with frames. the stream is a non-blocking one and does
+				not serialize with work on the legacy default stream, consumers on any
+				stream wait on the frame event with cudaStreamWaitEvent before touching
+				frame data.
+ */
+class CopyStream
+{
+public:
+	CopyStream() : stream(NULL), warnat(EventsWarn) {}
+
+	/**
+	 * Description: events are bounded by frames out of decoder, more than this many means
+					frames are returned without their event
+	 */
+	static const unsigned int EventsWarn = 256;
+
+	~CopyStream()
+	{
+		Destroy();
+	}
+
+	/**
+	 * Description: create stream in current context, copies fall back to legacy default
+					stream if it fails
+	 */
+	int Create()
+	{
+		int ret = 0;
+		if (!stream && (ret = cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking)))
+		{
+			FORMAT_WARNING("create copy stream failed", ret);
+			stream = NULL;
+		}
+
+		return ret;
+	}
+
+	void Destroy()
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		for (std::vector<cudaEvent_t>::iterator it = created.begin(); it != created.end(); it++)
+		{
+			cudaEventDestroy(*it);
+		}
+		created.clear();
+		idle.clear();
+		warnat = EventsWarn;
+
+		if (stream)
+		{
+			cudaStreamDestroy(stream);
+			stream = NULL;
+		}
+	}
+
+	inline cudaStream_t Stream()
+	{
+		return stream;
+	}
+
+	/**
+	 * Description: event recorded after copies issued so far, NULL if recording failed and
+					caller must synchronize the stream. context must be current.
+	 */
+	cudaEvent_t Record()
+	{
+		cudaEvent_t ev = NULL;
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			if (idle.size())
+			{
+				ev = idle.back();
+				idle.pop_back();
+			}
+		}
+
+		int ret = 0;
+		if (!ev)
+		{
+			if (ret = cudaEventCreateWithFlags(&ev, cudaEventDisableTiming))
+			{
+				FORMAT_WARNING("create copy event failed", ret);
+				return NULL;
+			}
+
+			boost::lock_guard<boost::mutex> lock(mtx);
+			created.push_back(ev);
+			if (created.size() >= warnat)
+			{
+				FORMAT_WARNING("copy events not returned", (int)(created.size() - idle.size()));
+				warnat *= 2;
+			}
+		}
+
+		if (ret = cudaEventRecord(ev, stream))
+		{
+			FORMAT_WARNING("record copy event failed", ret);
+			Release(ev);
+			return NULL;
+		}
+
+		return ev;
+	}
+
+	/**
+	 * Description: event of a returned frame goes back to pool
+	 */
+	inline void Release(void *ev)
+	{
+		if (!ev)
+			return;
+
+		boost::lock_guard<boost::mutex> lock(mtx);
+		idle.push_back((cudaEvent_t)ev);
+	}
+
+private:
+	cudaStream_t				stream;		/* copy stream, NULL for legacy default stream */
+	boost::mutex				mtx;		/* lock for events */
+	std::vector<cudaEvent_t>	created;	/* every event created */
+	std::vector<cudaEvent_t>	idle;		/* events not held by frames */
+	size_t						warnat;		/* event count of next leak warning */
+};
@@ -0,0 +1,359 @@
+#pragma once
+
+/**
+ * Description: optional C++20 coroutine stages. a coroutine stage co_awaits completion
+				events(cuda event, timer, or any CoroEvent set by another thread, e.g. a
+				file write completion) instead of blocking a thread, a few scheduler
+				threads multiplex all in-flight frames. compiled only with C++20.
+ */
+#if (__cplusplus >= 202002L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 202002L))
+#define PIPELINE_COROUTINE	1
+
+#include <coroutine>
+#include <functional>
+#include <exception>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include "cuda_runtime_api.h"
+#include "SmartFrame.h"
+
+using namespace std;
+
+/**
+ * Description: resumes suspended coroutines on a small pool of threads
+ */
+class CoroScheduler
+{
+public:
+	explicit CoroScheduler(unsigned int threads = 2, unsigned int poll_interval = 100 /* microsecond */)
+		: quit(false), inflight(0), pollus(max(poll_interval, 1u))
+	{
+		BOOST_ASSERT(threads > 0);
+
+		for (int i = 0; i < threads; i++)
+			workers.push_back(new boost::thread(boost::bind(&CoroScheduler::Routine, this)));
+	}
+
+	~CoroScheduler()
+	{
+		quit = true;
+		cv.notify_all();
+
+		for (int i = 0; i < workers.size(); i++)
+		{
+			if (workers[i]->joinable())
+				workers[i]->join();
+
+			delete workers[i];
+		}
+		workers.clear();
+
+		/**
+		 * Description: destroy coroutines never resumed, frames they hold are released
+		 */
+		for (int i = 0; i < ready.size(); i++)
+			ready[i].destroy();
+		ready.clear();
+
+		for (; timers.size(); timers.pop())
+			timers.top().second.destroy();
+
+		for (int i = 0; i < polls.size(); i++)
+			polls[i].second.destroy();
+		polls.clear();
+	}
+
+	/**
+	 * Description: resume "h" as soon as possible
+	 */
+	void Post(std::coroutine_handle<> h)
+	{
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			ready.push_back(h);
+		}
+		cv.notify_one();
+	}
+
+	/**
+	 * Description: resume "h" after "ms" milliseconds
+	 */
+	void After(unsigned int ms, std::coroutine_handle<> h)
+	{
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			timers.push(CoroTimer(boost::chrono::steady_clock::now() + boost::chrono::milliseconds(ms), h));
+		}
+		cv.notify_one();
+	}
+
+	/**
+	 * Description: resume "h" once "done" returns true, "done" is polled by scheduler threads
+	 */
+	void When(std::function<bool()> done, std::coroutine_handle<> h)
+	{
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			polls.push_back(CoroPoll(done, h));
+		}
+		cv.notify_one();
+	}
+
+	/**
+	 * Description: coroutines started and not finished yet
+	 */
+	inline unsigned int InFlight()
+	{
+		return inflight;
+	}
+
+private:
+	friend class CoroTask;
+
+	typedef std::pair<boost::chrono::steady_clock::time_point, std::coroutine_handle<> > CoroTimer;
+	typedef std::pair<std::function<bool()>, std::coroutine_handle<> > CoroPoll;
+
+	struct TimerLater
+	{
+		bool operator()(const CoroTimer &a, const CoroTimer &b) const { return a.first > b.first; }
+	};
+
+	void Routine()
+	{
+		while (!quit)
+		{
+			std::coroutine_handle<> h;
+			{
+				boost::unique_lock<boost::mutex> lock(mtx);
+
+				boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+
+				/**
+				 * Description: move due timers and completed polls to ready queue
+				 */
+				while (timers.size() && (timers.top().first <= now))
+				{
+					ready.push_back(timers.top().second);
+					timers.pop();
+				}
+
+				for (std::vector<CoroPoll>::iterator it = polls.begin(); it != polls.end();)
+				{
+					if (it->first())
+					{
+						ready.push_back(it->second);
+						it = polls.erase(it);
+					}
+					else
+					{
+						it++;
+					}
+				}
+
+				if (ready.empty())
+				{
+					/**
+					 * Description: sleep until next timer, next poll or new work
+					 */
+					boost::chrono::steady_clock::time_point until = now + boost::chrono::milliseconds(10);
+					if (polls.size())
+						until = now + boost::chrono::microseconds(pollus);
+					if (timers.size() && (timers.top().first < until))
+						until = timers.top().first;
+
+					cv.wait_until(lock, until);
+					continue;
+				}
+
+				h = ready.front();
+				ready.pop_front();
+			}
+
+			h.resume();
+		}
+	}
+
+private:
+	boost::atomic_bool										quit;		/* quit flag */
+	boost::atomic_uint32_t									inflight;	/* running coroutines */
+	unsigned int											pollus;		/* poll interval, microsecond */
+	boost::mutex											mtx;		/* lock for queues */
+	boost::condition_variable								cv;			/* new work notify */
+	std::deque<std::coroutine_handle<> >					ready;		/* coroutines to resume */
+	std::priority_queue<CoroTimer, std::vector<CoroTimer>, TimerLater>	timers;	/* sleeping coroutines */
+	std::vector<CoroPoll>									polls;		/* coroutines waiting for a condition */
+	std::vector<boost::thread*>								workers;	/* scheduler threads */
+};
+
+/**
+ * Description: coroutine stage return type. the task is created suspended, Start hands it
+				to a scheduler, "done" is invoked on the scheduler thread when it co_returns
+ */
+class CoroTask
+{
+public:
+	struct promise_type
+	{
+		CoroScheduler *				sched;
+		std::function<void()>		done;
+
+		promise_type() : sched(NULL) {}
+
+		CoroTask get_return_object() { return CoroTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept { return false; }
+			void await_resume() noexcept {}
+			void await_suspend(std::coroutine_handle<promise_type> h) noexcept
+			{
+				/**
+				 * Description: notify owner then free coroutine frame
+				 */
+				promise_type &p = h.promise();
+				std::function<void()> done;
+				done.swap(p.done);
+				CoroScheduler *sched = p.sched;
+
+				h.destroy();
+
+				if (done) done();
+				if (sched) sched->inflight--;
+			}
+		};
+
+		FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+		void return_void() {}
+		void unhandled_exception()
+		{
+			/* stage must not throw, frame is still forwarded by "done" */
+			std::cout << "[warning] coroutine stage threw an exception. err(-1)" << std::endl;
+		}
+	};
+
+	explicit CoroTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+	CoroTask(CoroTask &&t) noexcept : handle(t.handle) { t.handle = nullptr; }
+	CoroTask(const CoroTask &) = delete;
+	CoroTask & operator=(const CoroTask &) = delete;
+
+	~CoroTask()
+	{
+		/* never started */
+		if (handle) handle.destroy();
+	}
+
+	/**
+	 * Description: schedule the task, ownership of the coroutine moves to the scheduler
+	 */
+	void Start(CoroScheduler &sched, std::function<void()> done)
+	{
+		BOOST_ASSERT(handle);
+
+		handle.promise().sched	= &sched;
+		handle.promise().done	= done;
+		sched.inflight++;
+
+		std::coroutine_handle<promise_type> h = handle;
+		handle = nullptr;
+		sched.Post(h);
+	}
+
+private:
+	std::coroutine_handle<promise_type>	handle;
+};
+
+/**
+ * Description: co_await SleepFor(sched, ms)
+ */
+struct CoroSleep
+{
+	CoroScheduler &	sched;
+	unsigned int	ms;
+
+	bool await_ready() { return ms == 0; }
+	void await_suspend(std::coroutine_handle<> h) { sched.After(ms, h); }
+	void await_resume() {}
+};
+
+inline CoroSleep SleepFor(CoroScheduler &sched, unsigned int ms)
+{
+	return CoroSleep{ sched, ms };
+}
+
+/**
+ * Description: co_await PollUntil(sched, done), resumed once done() returns true
+ */
+struct CoroPollAwaiter
+{
+	CoroScheduler &			sched;
+	std::function<bool()>	done;
+
+	bool await_ready() { return done(); }
+	void await_suspend(std::coroutine_handle<> h) { sched.When(done, h); }
+	void await_resume() {}
+};
+
+inline CoroPollAwaiter PollUntil(CoroScheduler &sched, std::function<bool()> done)
+{
+	return CoroPollAwaiter{ sched, done };
+}
+
+/**
+ * Description: co_await WaitCudaEvent(sched, ev), resumed once work before ev completes
+ */
+inline CoroPollAwaiter WaitCudaEvent(CoroScheduler &sched, cudaEvent_t ev)
+{
+	return CoroPollAwaiter{ sched, [ev]() { return cudaEventQuery(ev) != cudaErrorNotReady; } };
+}
+
+/**
+ * Description: one-shot event set by any thread, e.g. an io completion callback.
+				"co_await event" suspends until Set is called.
+ */
+class CoroEvent
+{
+public:
+	explicit CoroEvent(CoroScheduler &s) : sched(s), set(false) {}
+
+	void Set()
+	{
+		std::vector<std::coroutine_handle<> > resume;
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			set = true;
+			resume.swap(waiters);
+		}
+
+		for (int i = 0; i < resume.size(); i++)
+			sched.Post(resume[i]);
+	}
+
+	bool await_ready() { return set; }
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		if (set) return false;	/* set in between, continue without suspending */
+		waiters.push_back(h);
+		return true;
+	}
+	void await_resume() {}
+
+private:
+	CoroScheduler &							sched;
+	boost::mutex							mtx;
+	boost::atomic_bool						set;
+	std::vector<std::coroutine_handle<> >	waiters;
+};
+
+/**
+ * Description: coroutine stage routine, "frame" is kept alive by the coroutine frame
+ */
+typedef CoroTask(*CoroRoutine)(ISmartFramePtr frame, CoroScheduler &sched, void *user);
+
+#endif
@@ -1,11 +1,15 @@
 #pragma once
 
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
 #include <boost/foreach.hpp>
 #include <algorithm>
 #include <iostream>
 #include <list>
 #include <map>
+#include <set>
 #include "cuda_runtime_api.h"
 
 #define FORMAT_OUTPUT(level, log, ret)	std::cout<<"["<<level<<"] "<<log\
@@ -113,6 +117,11 @@ public:
 	}
 };
 
+/**
+ * Description: Alloc waited "waited" ms for a buffer
+ */
+typedef void(*PoolStallRoutine)(unsigned int waited, void *user);
+
 template<class FrameAllocator = CpuAllocator>
 class DedicatedPool
 {
@@ -135,10 +144,16 @@ private:
 	};
 	std::list<FreeOnes>	freelist;
 	std::map<unsigned char*, unsigned int> worklist;
+	std::set<unsigned char*>	abandoned;	/* in use buffers never freed, still read by another process */
 	boost::recursive_mutex	lmtx;
+	boost::condition_variable_any	lcv;	/* buffer freed notify */
+	boost::atomic_bool		closed;			/* stop serving Alloc */
+	PoolStallRoutine		stallcb;		/* stall notify, NULL if unset */
+	void *					stalluser;		/* stall callback pointer */
+	unsigned int			stallms;		/* stall threshold, millisecond */
 
 public:
-	DedicatedPool(unsigned int len = 32) : poolsize(len)
+	DedicatedPool(unsigned int len = 32) : poolsize(len), closed(false), stallcb(NULL), stalluser(NULL), stallms(0)
 	{
 		if (len > PoolMax || len < PoolMin)
 			FORMAT_WARNING("pool size is out of range [2, 32768]", len);
@@ -158,7 +173,7 @@ public:
 		BOOST_FOREACH(WorkBuf &workbuf, worklist)
 		{
 			unsigned char *buf = NULL;
-			if (workbuf.first)
+			if (workbuf.first && !abandoned.count(workbuf.first))
 			{
 				buf = workbuf.first;
 				FrameAllocator::Free(buf);
@@ -181,11 +196,14 @@ public:
 		 */
 		worklist.clear();
 		freelist.clear();
+		abandoned.clear();
 	}
 
 	inline unsigned char * Alloc(unsigned int len)
 	{
 		unsigned char *buf = NULL;
+		boost::chrono::steady_clock::time_point start;
+		bool waiting = false, stalled = !stallcb;
 		do 
 		{
 			/**
@@ -249,6 +267,32 @@ public:
 				lmtx.unlock();
 			}
 
+			if (!buf && closed)
+			{
+				/**
+				 * Description: pool is draining, caller drops the frame
+				 */
+				break;
+			}
+
+			if (!buf && !stalled)
+			{
+				/**
+				 * Description: notify once per Alloc waiting longer than threshold
+				 */
+				boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+				if (!waiting)
+				{
+					start	= now;
+					waiting	= true;
+				}
+				else if ((now - start) >= boost::chrono::milliseconds(stallms))
+				{
+					stalled = true;
+					stallcb((unsigned int)boost::chrono::duration_cast<boost::chrono::milliseconds>(now - start).count(), stalluser);
+				}
+			}
+
 			boost::this_thread::sleep(boost::posix_time::microseconds(1500));
 			/**
 			 * Description: try until get suitable buffer
@@ -270,6 +314,13 @@ public:
 			FORMAT_WARNING("buffer unrecognized", 0);
 			return false;
 		}
+		else if (abandoned.erase(buf))
+		{
+			/**
+			 * Description: abandoned buffer leaves the pool without being freed
+			 */
+			worklist.erase(it);
+		}
 		else
 		{
 			/**
@@ -279,6 +330,78 @@ public:
 			worklist.erase(it);
 		}
 
+		lcv.notify_all();
+		return true;
+	}
+
+	/**
+	 * Description: in use "buf" is leaked instead of freed, on Free or pool destruction.
+					for buffers another process may still read. return false if "buf" is
+					not in use.
+	 */
+	inline bool Abandon(unsigned char* buf)
+	{
+		boost::lock_guard<boost::recursive_mutex> lock(lmtx);
+
+		if (worklist.find(buf) == worklist.end())
+			return false;
+
+		abandoned.insert(buf);
+		return true;
+	}
+
+	/**
+	 * Description: call "routine" when an Alloc waits longer than "threshold" ms, set before
+					the pool is used
+	 */
+	inline void OnStall(PoolStallRoutine routine, void *user, unsigned int threshold = 100)
+	{
+		stallcb		= routine;
+		stalluser	= user;
+		stallms		= threshold;
+	}
+
+	/**
+	 * Description: stop serving Alloc, a blocked or later Alloc returns NULL
+	 */
+	inline void Close()
+	{
+		closed = true;
+	}
+
+	/**
+	 * Description: close pool, wait at most "timeout" ms for all buffers freed, then
+					release free buffers. return true if no buffer is in use.
+	 */
+	bool Drain(unsigned int timeout)
+	{
+		Close();
+
+		boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(timeout);
+
+		boost::unique_lock<boost::recursive_mutex> lock(lmtx);
+		while (worklist.size())
+		{
+			if (lcv.wait_until(lock, deadline) == boost::cv_status::timeout)
+				break;
+		}
+
+		BOOST_FOREACH(FreeOnes &freebuf, freelist)
+		{
+			if (freebuf.buf)
+			{
+				FrameAllocator::Free(freebuf.buf);
+				freebuf.buf = NULL;
+			}
+		}
+		freelist.clear();
+
+		if (worklist.size())
+		{
+			FORMAT_WARNING("pool drain timeout, buffers still in use", worklist.size());
+			return false;
+		}
+
 		return true;
 	}
 
@@ -290,6 +413,11 @@ public:
 		return poolsize += addition;
 	}
 
+	inline unsigned int size()
+	{
+		return poolsize;
+	}
+
 	//boost::atomic_uint32_t aidx = 0;
 	//boost::atomic_uint32_t fidx = 0;
 };
@@ -16,6 +16,7 @@ extern "C"
 
 #include "DedicatedPool.h"
 #include "BaseCodec.h"
+#include "CopyStream.h"
 
 using namespace std;
 
@@ -196,6 +197,9 @@ namespace FFCodec
 					throw ret;
 				}
 			}
+
+			/* uploads are ordered on the codec's own stream */
+			copystream.Create();
 		}
 
 		~FFMpegCodec()
@@ -315,9 +319,14 @@ namespace FFCodec
 					return -1;
 				}
 
+				/* host frame stays busy until PutFrame, so the upload may still run */
 				int ret = 0;
-				ret = cudaMemcpy(pic.dev_frame, pic.host_frame, (avf->width * avf->height * 3) >> 1, cudaMemcpyHostToDevice);
+				pic.ready = NULL;
+				ret = cudaMemcpyAsync(pic.dev_frame, pic.host_frame, (avf->width * avf->height * 3) >> 1, cudaMemcpyHostToDevice, copystream.Stream());
 				// ret = cuMemcpyHtoD(pic.dev_frame, pic.host_frame, (avf->width * avf->height * 3) >> 1);
+				if (!ret && !(pic.ready = copystream.Record()))
+					ret = cudaStreamSynchronize(copystream.Stream());
+
 				if (ret)
 				{
 					FORMAT_FATAL("copy from host to device failed", ret);
@@ -340,6 +349,8 @@ namespace FFCodec
 			if (it == dev2host.end()) return false;
 			void *p = it->second;
 			dev2host.erase(it);
+			copystream.Release(pic.ready);
+			pic.ready = NULL;
 			return (devpool->Free((unsigned char*)pic.dev_frame) && avfpool.Free(p));
 		}
 
@@ -363,6 +374,7 @@ namespace FFCodec
 		struct SwsContext *	img_convert_ctx;
 		DevicePool			*devpool;
 		bool				bLocalPool;
+		CopyStream			copystream;	/* stream of uploads and their events */
 	};
 
 	class FFMediaSource : public BaseMediaSource
@@ -473,6 +485,8 @@ namespace FFCodec
 
 		void MediaReader(std::string &filename)
 		{
+			ThreadPlacement::Instance().Pin(PSReader, node);
+
 			while (av_read_frame(pFormatCtx, packet) >= 0 && bplaying/* exit flag */)
 			{
 				if (packet->stream_index == videoindex) {
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <string>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <nvcuvid.h>
+
+#include "FFCodec.h"
+
+namespace FFCodec
+{
+	/**
+	 * Description: container demuxer feeding elementary stream packets with timestamps to a
+					gpu decoder. avcC/hvcC packets of mp4 like containers are converted to
+					annex-b, mpeg-4 part 2 configuration is sent before the first packet.
+	 */
+	class FFDemuxSource : public BaseMediaSource
+	{
+	public:
+		/**
+		 * Description: nvdec codec of the video stream in "srcvideo", false if the stream can
+						not be decoded by nvdec into nv12. FFInit must be called first.
+		 */
+		static bool Probe(std::string srcvideo, cudaVideoCodec &codec)
+		{
+			AVFormatContext *ctx = NULL;
+			if (avformat_open_input(&ctx, srcvideo.c_str(), NULL, NULL) != 0)
+				return false;
+
+			bool ok = false;
+			if (avformat_find_stream_info(ctx, NULL) >= 0)
+			{
+				int idx = av_find_best_stream(ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+				ok = (idx >= 0) && NvCodecOf(ctx->streams[idx]->codecpar, codec);
+			}
+
+			avformat_close_input(&ctx);
+			return ok;
+		}
+
+		/**
+		 * Description: 8 bit 4:2:0 streams of the codecs nvdec parses
+		 */
+		static bool NvCodecOf(const AVCodecParameters *par, cudaVideoCodec &codec)
+		{
+			switch (par->format)
+			{
+			case AV_PIX_FMT_NONE:
+			case AV_PIX_FMT_YUV420P:
+			case AV_PIX_FMT_YUVJ420P:
+			case AV_PIX_FMT_NV12:
+				break;
+			default:
+				return false;
+			}
+
+			switch (par->codec_id)
+			{
+			case AV_CODEC_ID_H264:	codec = cudaVideoCodec_H264;	return true;
+			case AV_CODEC_ID_HEVC:	codec = cudaVideoCodec_HEVC;	return true;
+			case AV_CODEC_ID_MPEG4:	codec = cudaVideoCodec_MPEG4;	return true;
+			case AV_CODEC_ID_VP8:	codec = cudaVideoCodec_VP8;		return true;
+			case AV_CODEC_ID_VP9:	codec = cudaVideoCodec_VP9;		return true;
+			case AV_CODEC_ID_MJPEG:	codec = cudaVideoCodec_JPEG;	return true;
+			default:				return false;
+			}
+		}
+
+		FFDemuxSource(std::string srcvideo, BaseCodec *dec, bool looplay = false)
+			: BaseMediaSource(srcvideo, dec, looplay), reader(NULL), pFormatCtx(NULL), bsf(NULL), packet(NULL), eomf(false)
+		{
+			if (avformat_open_input(&pFormatCtx, srcvideo.c_str(), NULL, NULL) != 0) {
+				printf("Couldn't open input stream.\n");
+				throw (-1);
+			}
+
+			if (avformat_find_stream_info(pFormatCtx, NULL) < 0) {
+				avformat_close_input(&pFormatCtx);
+				printf("Couldn't find stream information.\n");
+				throw (-1);
+			}
+
+			videoindex = av_find_best_stream(pFormatCtx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+			if (videoindex < 0) {
+				avformat_close_input(&pFormatCtx);
+				printf("Didn't find a video stream.\n");
+				throw (-1);
+			}
+
+			AVStream *stream = pFormatCtx->streams[videoindex];
+			timebase = stream->time_base;
+
+			/**
+			 * Description: length prefixed h264/hevc carries avcC/hvcC extradata, whose first
+							byte is the configuration version 1
+			 */
+			AVCodecParameters *par = stream->codecpar;
+			if (((par->codec_id == AV_CODEC_ID_H264) || (par->codec_id == AV_CODEC_ID_HEVC))
+				&& (par->extradata_size > 0) && (par->extradata[0] == 1))
+			{
+				const AVBitStreamFilter *filter = av_bsf_get_by_name((par->codec_id == AV_CODEC_ID_H264) ? "h264_mp4toannexb" : "hevc_mp4toannexb");
+				if (filter && (av_bsf_alloc(filter, &bsf) >= 0) && (avcodec_parameters_copy(bsf->par_in, par) >= 0))
+				{
+					bsf->time_base_in = timebase;
+					if (av_bsf_init(bsf) < 0)
+						av_bsf_free(&bsf);
+				}
+				else
+				{
+					av_bsf_free(&bsf);
+				}
+
+				if (!bsf)
+				{
+					avformat_close_input(&pFormatCtx);
+					printf("Couldn't create annex-b filter.\n");
+					throw (-1);
+				}
+
+				timebase = bsf->time_base_out;
+			}
+
+			packet = av_packet_alloc();
+			BOOST_ASSERT(packet);
+
+			reader = new boost::thread(boost::bind(&FFDemuxSource::MediaReader, this, src));
+			BOOST_ASSERT(reader);
+		}
+
+		virtual ~FFDemuxSource()
+		{
+			eomf = true;
+			if (reader && reader->joinable())
+			{
+				reader->join();
+				delete reader;
+				reader = NULL;
+			}
+
+			av_packet_free(&packet);
+			av_bsf_free(&bsf);
+
+			if (pFormatCtx)
+			{
+				avformat_close_input(&pFormatCtx);
+				pFormatCtx = NULL;
+			}
+		}
+
+		inline bool Eof()
+		{
+			return eomf.load();
+		}
+
+		void MediaReader(std::string &filename)
+		{
+			ThreadPlacement::Instance().Pin(PSReader, node);
+
+			AVCodecParameters *par = pFormatCtx->streams[videoindex]->codecpar;
+
+			/**
+			 * Description: mpeg-4 part 2 vol headers live in extradata of containers
+			 */
+			if ((par->codec_id == AV_CODEC_ID_MPEG4) && (par->extradata_size > 0))
+			{
+				decoder->InputStream(par->extradata, par->extradata_size);
+			}
+
+			while (!eomf)
+			{
+				if (av_read_frame(pFormatCtx, packet) < 0)
+				{
+					if (loop && (av_seek_frame(pFormatCtx, videoindex, 0, AVSEEK_FLAG_BACKWARD) >= 0))
+						continue;
+					break;
+				}
+
+				if (packet->stream_index == videoindex)
+				{
+					Feed(packet);
+				}
+				av_packet_unref(packet);
+			}
+
+			/**
+			 * Description: drain filter and notify end of file
+			 */
+			Feed(NULL);
+			decoder->InputStream(NULL, 0);
+
+			eomf = true;
+		}
+
+	private:
+		/**
+		 * Description: pass "pkt" through annex-b filter if any to decoder, NULL flushes
+		 */
+		void Feed(AVPacket *pkt)
+		{
+			if (!bsf)
+			{
+				if (pkt)	Input(pkt);
+				return;
+			}
+
+			if (av_bsf_send_packet(bsf, pkt) < 0)
+			{
+				FORMAT_WARNING("annex-b filter rejected packet", -1);
+				return;
+			}
+
+			AVPacket *out = av_packet_alloc();
+			while (av_bsf_receive_packet(bsf, out) == 0)
+			{
+				Input(out);
+				av_packet_unref(out);
+			}
+			av_packet_free(&out);
+		}
+
+		inline void Input(AVPacket *pkt)
+		{
+			static const AVRational clock = { 1, 10000000 };	/* parser default clock rate */
+
+			long long ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+			if (ts == AV_NOPTS_VALUE)
+				decoder->InputStream(pkt->data, pkt->size);
+			else
+				decoder->InputStream(pkt->data, pkt->size, av_rescale_q(ts, timebase, clock));
+		}
+
+	private:
+		boost::thread *		reader;			/* demuxing thread handle */
+		AVFormatContext *	pFormatCtx;		/* video format context */
+		AVBSFContext *		bsf;			/* mp4 to annex-b filter, NULL if not needed */
+		AVPacket *			packet;			/* demuxed packet */
+		AVRational			timebase;		/* timestamp unit of packets fed */
+		int					videoindex;		/* video stream index */
+		boost::atomic_bool	eomf;			/* end of media flag */
+	};
+}
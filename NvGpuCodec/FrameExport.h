@@ -0,0 +1,585 @@
+#pragma once
+
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/cstdint.hpp>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <new>
+#include <iostream>
+#include "cuda.h"
+#include "cuda_runtime_api.h"
+#include "SmartFrame.h"
+#include "DedicatedPool.h"
+
+#define FRAME_EXPORT_MAGIC		0x5845564E	/* "NVEX" */
+#define FRAME_EXPORT_VERSION	1
+
+/* bound of waiting for the importer to ack device frames on destruction, millisecond */
+const unsigned int ExportAckWait = 1000;
+
+/**
+ * Description: how frame pixels cross the process boundary
+ */
+enum ExportMode
+{
+	EMHost = 0,		/* nv12 copied into the ring payload from the frame host mirror */
+	EMDevice = 1,	/* cuda ipc handle of the device buffer, zero-copy */
+};
+
+/**
+ * Description: slot state, written by exporter(free, published) and importer(acked)
+ */
+enum ExportState
+{
+	ESFree = 0,
+	ESPublished = 1,
+	ESAcked = 2,
+};
+
+/**
+ * Description: shared ring layout, header, "slots" slot descriptors, then "slots" payloads
+				of "slotbytes" each. atomics are lock-free and address-free, so they work
+				across processes.
+ */
+struct ExportHeader
+{
+	boost::uint32_t			magic;		/* FRAME_EXPORT_MAGIC */
+	boost::uint32_t			version;	/* FRAME_EXPORT_VERSION */
+	boost::uint32_t			slots;		/* ring slots */
+	boost::uint32_t			slotbytes;	/* payload bytes of each slot, host mode */
+	boost::atomic_uint64_t	head;		/* next sequence to publish */
+	boost::atomic_uint64_t	dropped;	/* frames not exported, ring full or too big */
+	boost::atomic_uint32_t	closed;		/* exporter is gone */
+};
+
+struct ExportSlot
+{
+	boost::atomic_uint32_t	state;		/* ExportState */
+	boost::uint32_t			mode;		/* ExportMode */
+	boost::uint64_t			seq;		/* publish sequence */
+	boost::uint32_t			width;
+	boost::uint32_t			height;
+	boost::uint32_t			step;
+	boost::uint32_t			tid;
+	boost::uint32_t			frameno;
+	boost::uint32_t			last;
+	boost::uint64_t			timestamp;
+	boost::uint64_t			batch;		/* frames of one exported batch share it */
+	boost::uint32_t			batchidx;	/* index in batch */
+	boost::uint32_t			batchlen;	/* batch length */
+	boost::uint64_t			lumaoff;	/* luma offset, in payload for host mode, from allocation base for device mode */
+	boost::uint64_t			chromaoff;	/* uv offset, same base as lumaoff */
+	cudaIpcMemHandle_t		handle;		/* device allocation, device mode */
+};
+
+/**
+ * Description: publishes frames and batches into a named shared memory ring for one
+				importer process. in device mode the exporter keeps each frame referenced
+				until the importer acks it, so its buffer returns to DevicePool only after
+				the remote side is done. frames not acked on destruction have their buffers
+				abandoned in "devpool", without it they stay referenced and the pool owning
+				them can not drain, so destroy the exporter after the importer closed its
+				handles. a full ring drops frames instead of blocking.
+				zero-copy decoder surfaces can not be shared through ipc, device mode is
+				refused for them.
+ */
+class FrameExporter
+{
+public:
+	FrameExporter(const std::string &name, ExportMode mode, unsigned int slots = 64,
+		unsigned int slotbytes = (1920 * 1088 * 3 / 2) /* host mode payload */, void *cuctx = NULL,
+		bool mapped = false /* frames are zero-copy decoder surfaces, see FrameBatchPipe::ZeroCopyHeld */,
+		DevicePool *devpool = NULL /* pool of frame buffers, see FrameBatchPipe::DeviceBuffers */)
+		: shmname(name), exmode(mode), nslots(slots), payloadlen((mode == EMHost) ? slotbytes : 0), cudactx(cuctx), pool(devpool), tail(0), batchseq(0)
+	{
+		BOOST_ASSERT(slots > 0);
+
+		if (mapped && (mode == EMDevice))
+		{
+			FORMAT_WARNING("device frame export of zero-copy decoder surfaces refused", 0);
+			throw("device frame export of zero-copy frames refused");
+		}
+
+		try
+		{
+			boost::interprocess::shared_memory_object::remove(shmname.c_str());
+			shm = boost::interprocess::shared_memory_object(boost::interprocess::create_only, shmname.c_str(), boost::interprocess::read_write);
+			shm.truncate(Size(nslots, payloadlen));
+			region = boost::interprocess::mapped_region(shm, boost::interprocess::read_write);
+		}
+		catch (boost::interprocess::interprocess_exception &e)
+		{
+			FORMAT_WARNING("create frame export ring " << shmname << " failed, " << e.what(), e.get_error_code());
+			throw("create frame export ring failed");
+		}
+
+		header = new (region.get_address()) ExportHeader();
+		header->magic		= FRAME_EXPORT_MAGIC;
+		header->version		= FRAME_EXPORT_VERSION;
+		header->slots		= nslots;
+		header->slotbytes	= payloadlen;
+		header->head		= 0;
+		header->dropped		= 0;
+		header->closed		= 0;
+
+		slot = reinterpret_cast<ExportSlot*>(header + 1);
+		for (unsigned int i = 0; i < nslots; i++)
+			new (&slot[i]) ExportSlot();
+
+		payload = reinterpret_cast<unsigned char*>(slot + nslots);
+		held.resize(nslots);
+		heldbase.resize(nslots);
+
+		if (!header->head.is_lock_free() || !slot[0].state.is_lock_free())
+		{
+			FORMAT_WARNING("atomics are not lock-free, frame export ring can not be shared", 0);
+		}
+	}
+
+	~FrameExporter()
+	{
+		/**
+		 * Description: importer stops waiting for new frames, frames it still reads are
+						released once acked. frames not acked in time may still be read,
+						their buffers are abandoned in the device pool and the frames go
+						back. without a device pool the frames stay referenced, their pool
+						does not drain and frees the buffers on destruction anyway.
+		 */
+		header->closed = 1;
+
+		boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(ExportAckWait);
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			while (exmode == EMDevice)
+			{
+				Release();
+				if ((tail >= header->head.load(boost::memory_order_relaxed)) || (boost::chrono::steady_clock::now() >= deadline))
+					break;
+
+				boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+			}
+
+			unsigned int abandoned = 0, kept = 0;
+			for (unsigned int i = 0; i < held.size(); i++)
+			{
+				if (!held[i])
+					continue;
+
+				if (pool && pool->Abandon(heldbase[i]))
+				{
+					/* buffer is leaked when the frame returns */
+					held[i] = NULL;
+					abandoned++;
+				}
+				else
+				{
+					/* reference is dropped without release */
+					held[i].detach();
+					kept++;
+				}
+			}
+
+			if (abandoned)
+			{
+				FORMAT_WARNING("frames not acked by importer, device buffers abandoned", abandoned);
+			}
+
+			if (kept)
+			{
+				FORMAT_WARNING("frames not acked by importer, frames kept referenced", kept);
+			}
+			held.clear();
+			heldbase.clear();
+		}
+
+		boost::interprocess::shared_memory_object::remove(shmname.c_str());
+	}
+
+	/**
+	 * Description: publish one frame, return false if dropped
+	 */
+	bool Export(ISmartFramePtr frame)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		return Publish(frame, ++batchseq, 0, 1);
+	}
+
+	/**
+	 * Description: publish a batch, frames share a batch sequence, return frames published
+	 */
+	unsigned int ExportBatch(ISmartFramePtr *p, unsigned int len)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		unsigned int n = 0;
+		boost::uint64_t batch = ++batchseq;
+		for (unsigned int i = 0; i < len; i++)
+		{
+			if (p[i] && Publish(p[i], batch, i, len))
+				n++;
+		}
+
+		return n;
+	}
+
+	/**
+	 * Description: release frames acked by importer, in publish order. called by every
+					export, call it when idle to return buffers earlier
+	 */
+	unsigned int Reclaim()
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		return Release();
+	}
+
+	inline unsigned long long Dropped()
+	{
+		return header->dropped;
+	}
+
+	/**
+	 * Description: bytes of the shared ring
+	 */
+	static inline unsigned long long Size(unsigned int slots, unsigned int slotbytes)
+	{
+		return sizeof(ExportHeader) + (unsigned long long)slots * (sizeof(ExportSlot) + slotbytes);
+	}
+
+private:
+	inline unsigned int Release()
+	{
+		unsigned int n = 0;
+		boost::uint64_t head = header->head.load(boost::memory_order_relaxed);
+		while ((tail < head) && (slot[tail % nslots].state.load(boost::memory_order_acquire) == ESAcked))
+		{
+			held[tail % nslots]		= NULL;
+			heldbase[tail % nslots]	= NULL;
+			slot[tail % nslots].state.store(ESFree, boost::memory_order_release);
+			tail++;
+			n++;
+		}
+
+		return n;
+	}
+
+	bool Publish(ISmartFramePtr &frame, boost::uint64_t batch, unsigned int idx, unsigned int len)
+	{
+		Release();
+
+		boost::uint64_t seq = header->head.load(boost::memory_order_relaxed);
+		ExportSlot &s = slot[seq % nslots];
+		if (s.state.load(boost::memory_order_acquire) != ESFree)
+		{
+			/* importer lags behind by a whole ring */
+			header->dropped++;
+			return false;
+		}
+
+		s.mode		= exmode;
+		s.seq		= seq;
+		s.width		= frame->Width();
+		s.height	= frame->Height();
+		s.tid		= frame->Tid();
+		s.frameno	= frame->FrameNo();
+		s.last		= frame->LastFrame();
+		s.timestamp	= frame->Timestamp();
+		s.batch		= batch;
+		s.batchidx	= idx;
+		s.batchlen	= len;
+
+		if (exmode == EMHost)
+		{
+			/**
+			 * Description: host mirror is nv12 with step equal to width
+			 */
+			unsigned int lumalen = s.width * s.height;
+			unsigned char *h = frame->Host();
+			if (!h || ((lumalen + (lumalen >> 1)) > payloadlen))
+			{
+				header->dropped++;
+				return false;
+			}
+
+			memcpy(payload + (seq % nslots) * (unsigned long long)payloadlen, h, lumalen + (lumalen >> 1));
+			s.step		= s.width;
+			s.lumaoff	= 0;
+			s.chromaoff	= lumalen;
+		}
+		else
+		{
+			if (cudactx) cuCtxPushCurrent((CUcontext)cudactx);
+
+			/**
+			 * Description: ipc handles describe whole allocations, frame may start inside one
+			 */
+			CUdeviceptr base = 0;
+			size_t size = 0;
+			int ret = cuMemGetAddressRange(&base, &size, (CUdeviceptr)frame->NV12());
+			if (!ret)
+				ret = cudaIpcGetMemHandle(&s.handle, (void*)base);
+
+			/* importer can not wait on our events, data must be complete when published */
+			if (!ret && frame->Ready())
+				ret = cudaEventSynchronize((cudaEvent_t)frame->Ready());
+
+			if (cudactx) cuCtxPopCurrent(NULL);
+
+			if (ret)
+			{
+				FORMAT_WARNING("get cuda ipc handle failed", ret);
+				header->dropped++;
+				return false;
+			}
+
+			s.step		= frame->Step();
+			s.lumaoff	= (CUdeviceptr)frame->NV12() - base;
+			s.chromaoff	= (CUdeviceptr)frame->Chroma() - base;
+
+			/* buffer stays out of pool until importer acks */
+			held[seq % nslots]		= frame;
+			heldbase[seq % nslots]	= (unsigned char*)base;
+		}
+
+		s.state.store(ESPublished, boost::memory_order_release);
+		header->head.store(seq + 1, boost::memory_order_release);
+		return true;
+	}
+
+private:
+	std::string								shmname;	/* shared memory name */
+	ExportMode								exmode;		/* pixel transport */
+	unsigned int							nslots;		/* ring slots */
+	unsigned int							payloadlen;	/* payload bytes of each slot */
+	void *									cudactx;	/* context of device frames */
+	DevicePool *							pool;		/* pool of frame buffers, NULL if unknown */
+	boost::interprocess::shared_memory_object	shm;	/* shared memory */
+	boost::interprocess::mapped_region		region;		/* mapping of shm */
+	ExportHeader *							header;		/* ring header in region */
+	ExportSlot *							slot;		/* slot descriptors in region */
+	unsigned char *							payload;	/* slot payloads in region */
+	std::vector<ISmartFramePtr>				held;		/* frames waiting for ack, device mode */
+	std::vector<unsigned char*>				heldbase;	/* allocation base of each held frame */
+	boost::uint64_t							tail;		/* oldest sequence not reclaimed */
+	boost::uint64_t							batchseq;	/* batch sequence */
+	boost::mutex							mtx;		/* lock for publishing */
+};
+
+/**
+ * Description: frame received from an exporter, valid until acked
+ */
+struct ImportedFrame
+{
+	unsigned char *		luma;		/* host pointer into the ring, or device pointer mapped in this process */
+	unsigned char *		chroma;		/* interleaved uv, same step as luma */
+	unsigned int		width;
+	unsigned int		height;
+	unsigned int		step;
+	unsigned int		tid;
+	unsigned int		frameno;
+	bool				last;
+	unsigned long long	timestamp;
+	unsigned long long	batch;		/* frames of one exported batch share it */
+	unsigned int		batchidx;	/* index in batch */
+	unsigned int		batchlen;	/* batch length */
+	ExportMode			mode;		/* luma/chroma are host or device pointers */
+	unsigned long long	seq;		/* ack handle */
+};
+
+/**
+ * Description: receives frames of a FrameExporter ring in another process. every frame
+				must be acked, the exporter reuses its slot and returns its buffer after
+				that. device allocations are opened once and kept while they may be used.
+ */
+class FrameImporter
+{
+public:
+	explicit FrameImporter(const std::string &name, void *cuctx = NULL) : cudactx(cuctx), next(0)
+	{
+		try
+		{
+			shm = boost::interprocess::shared_memory_object(boost::interprocess::open_only, name.c_str(), boost::interprocess::read_write);
+			region = boost::interprocess::mapped_region(shm, boost::interprocess::read_write);
+		}
+		catch (boost::interprocess::interprocess_exception &e)
+		{
+			FORMAT_WARNING("open frame export ring " << name << " failed, " << e.what(), e.get_error_code());
+			throw("open frame export ring failed");
+		}
+
+		header = reinterpret_cast<ExportHeader*>(region.get_address());
+		if ((region.get_size() < sizeof(ExportHeader)) || (header->magic != FRAME_EXPORT_MAGIC) || (header->version != FRAME_EXPORT_VERSION)
+			|| (region.get_size() < FrameExporter::Size(header->slots, header->slotbytes)))
+		{
+			FORMAT_WARNING("frame export ring " << name << " is not compatible", header->version);
+			throw("frame export ring is not compatible");
+		}
+
+		nslots	= header->slots;
+		slot	= reinterpret_cast<ExportSlot*>(header + 1);
+		payload	= reinterpret_cast<unsigned char*>(slot + nslots);
+
+		/**
+		 * Description: take over from a previous importer, frames it never acked are acked
+		 */
+		next = header->head.load(boost::memory_order_acquire);
+		for (unsigned int i = 0; i < nslots; i++)
+		{
+			if ((slot[i].state.load(boost::memory_order_acquire) == ESPublished) && (slot[i].seq < next))
+				slot[i].state.store(ESAcked, boost::memory_order_release);
+		}
+	}
+
+	~FrameImporter()
+	{
+		if (cudactx) cuCtxPushCurrent((CUcontext)cudactx);
+
+		for (std::map<std::string, ImportedMem>::iterator it = opened.begin(); it != opened.end(); it++)
+			cudaIpcCloseMemHandle(it->second.base);
+		opened.clear();
+
+		if (cudactx) cuCtxPopCurrent(NULL);
+	}
+
+	/**
+	 * Description: wait at most "timeout" ms for the next frame, return false on timeout or
+					if the exporter is gone
+	 */
+	bool Next(ImportedFrame &f, unsigned int timeout)
+	{
+		boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(timeout);
+
+		ExportSlot &s = slot[next % nslots];
+		while ((s.state.load(boost::memory_order_acquire) != ESPublished) || (s.seq != next))
+		{
+			if (header->closed || (boost::chrono::steady_clock::now() >= deadline))
+				return false;
+
+			boost::this_thread::sleep(boost::posix_time::microseconds(100));
+		}
+
+		f.width		= s.width;
+		f.height	= s.height;
+		f.step		= s.step;
+		f.tid		= s.tid;
+		f.frameno	= s.frameno;
+		f.last		= (s.last != 0);
+		f.timestamp	= s.timestamp;
+		f.batch		= s.batch;
+		f.batchidx	= s.batchidx;
+		f.batchlen	= s.batchlen;
+		f.mode		= (ExportMode)s.mode;
+		f.seq		= s.seq;
+
+		if (f.mode == EMHost)
+		{
+			unsigned char *base = payload + (next % nslots) * (unsigned long long)header->slotbytes;
+			f.luma		= base + s.lumaoff;
+			f.chroma	= base + s.chromaoff;
+		}
+		else
+		{
+			unsigned char *base = Open(s.handle);
+			if (!base)
+			{
+				/* can not map, give the frame back */
+				s.state.store(ESAcked, boost::memory_order_release);
+				next++;
+				return false;
+			}
+
+			f.luma		= base + s.lumaoff;
+			f.chroma	= base + s.chromaoff;
+		}
+
+		next++;
+		return true;
+	}
+
+	/**
+	 * Description: done with "f", its pixels must not be touched any more
+	 */
+	void Ack(const ImportedFrame &f)
+	{
+		ExportSlot &s = slot[f.seq % nslots];
+		if (s.seq == f.seq)
+			s.state.store(ESAcked, boost::memory_order_release);
+	}
+
+	inline unsigned long long Dropped()
+	{
+		return header->dropped;
+	}
+
+private:
+	struct ImportedMem
+	{
+		unsigned char *		base;		/* mapped allocation */
+		unsigned long long	lastseq;	/* latest frame using it */
+	};
+
+	/**
+	 * Description: map the allocation of "handle", reusing earlier mappings. a mapping not
+					used for a whole ring is closed, every frame using it has been acked
+	 */
+	unsigned char * Open(const cudaIpcMemHandle_t &handle)
+	{
+		std::string key(handle.reserved, sizeof(handle.reserved));
+
+		std::map<std::string, ImportedMem>::iterator it = opened.find(key);
+		if (it != opened.end())
+		{
+			it->second.lastseq = next;
+			return it->second.base;
+		}
+
+		if (cudactx) cuCtxPushCurrent((CUcontext)cudactx);
+
+		for (it = opened.begin(); it != opened.end();)
+		{
+			if ((it->second.lastseq + nslots) < next)
+			{
+				cudaIpcCloseMemHandle(it->second.base);
+				opened.erase(it++);
+			}
+			else
+			{
+				it++;
+			}
+		}
+
+		void *base = NULL;
+		int ret = cudaIpcOpenMemHandle(&base, handle, cudaIpcMemLazyEnablePeerAccess);
+
+		if (cudactx) cuCtxPopCurrent(NULL);
+
+		if (ret)
+		{
+			FORMAT_WARNING("open cuda ipc handle failed", ret);
+			return NULL;
+		}
+
+		ImportedMem mem;
+		mem.base	= (unsigned char*)base;
+		mem.lastseq	= next;
+		opened[key]	= mem;
+
+		return mem.base;
+	}
+
+private:
+	void *									cudactx;	/* context device frames are mapped into */
+	boost::interprocess::shared_memory_object	shm;	/* shared memory */
+	boost::interprocess::mapped_region		region;		/* mapping of shm */
+	ExportHeader *							header;		/* ring header in region */
+	ExportSlot *							slot;		/* slot descriptors in region */
+	unsigned char *							payload;	/* slot payloads in region */
+	unsigned int							nslots;		/* ring slots */
+	boost::uint64_t							next;		/* next sequence to receive */
+	std::map<std::string, ImportedMem>		opened;		/* device allocations mapped, by handle */
+};
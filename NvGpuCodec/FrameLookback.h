@@ -0,0 +1,232 @@
+#pragma once
+
+#include <boost/thread/mutex.hpp>
+#include <boost/assert.hpp>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include "SmartFrame.h"
+
+/**
+ * Description: per-stream lookback rings holding references to decoded frames. each stream
+				keeps its latest "depth" frames, one of every "decimation" frames is kept.
+				retained frames occupy pool frames and device buffers, so all rings share a
+				bound of "budget" bytes and "maxframes" frames, the oldest frame of the
+				largest ring is evicted first when a bound is reached.
+ */
+class FrameLookback
+{
+public:
+	FrameLookback(unsigned int depth, unsigned int decimation, unsigned long long budget, unsigned int maxframes)
+		: ringdepth(depth), decim(std::max(decimation, 1u)), bytebudget(budget), framebudget(maxframes), bytes(0), frames(0)
+	{
+		BOOST_ASSERT(depth > 0);
+	}
+
+	~FrameLookback()
+	{
+		Clear();
+	}
+
+	/**
+	 * Description: offer a decoded frame of its stream, kept according to decimation. last
+					frame ends the stream and releases its ring.
+	 */
+	void Retain(ISmartFramePtr frame)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		if (frame->LastFrame())
+		{
+			Drop(frame->Tid());
+			return;
+		}
+
+		LookbackRing &ring = rings[frame->Tid()];
+		if (ring.slots.empty())
+			ring.slots.resize(ringdepth);
+
+		if ((ring.offered++ % decim) != 0)
+			return;
+
+		unsigned long long len = Bytes(frame);
+		if (ring.count == ringdepth)
+			PopOldest(ring);
+
+		/**
+		 * Description: make room within the shared bound
+		 */
+		while (((bytes + len) > bytebudget) || ((frames + 1) > framebudget))
+		{
+			LookbackRing *largest = Largest();
+			if (!largest)
+				return;
+			PopOldest(*largest);
+		}
+
+		ring.slots[(ring.head + ring.count) % ringdepth] = frame;
+		ring.count++;
+		ring.bytes += len;
+		bytes += len;
+		frames++;
+	}
+
+	/**
+	 * Description: retained frame "frameno" of stream "tid", NULL if not retained
+	 */
+	ISmartFramePtr Find(unsigned int tid, unsigned int frameno)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		std::map<unsigned int, LookbackRing>::iterator it = rings.find(tid);
+		if (it == rings.end())
+			return NULL;
+
+		LookbackRing &ring = it->second;
+		for (unsigned int i = 0; i < ring.count; i++)
+		{
+			ISmartFramePtr &f = ring.slots[(ring.head + i) % ringdepth];
+			if (f->FrameNo() == frameno)
+				return f;
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Description: retained frames of stream "tid" with timestamp in ["begin", "end"], oldest
+					first, appended to "out". return count appended.
+	 */
+	unsigned int Range(unsigned int tid, unsigned long long begin, unsigned long long end, std::vector<ISmartFramePtr> &out)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		std::map<unsigned int, LookbackRing>::iterator it = rings.find(tid);
+		if (it == rings.end())
+			return 0;
+
+		unsigned int n = 0;
+		LookbackRing &ring = it->second;
+		for (unsigned int i = 0; i < ring.count; i++)
+		{
+			ISmartFramePtr &f = ring.slots[(ring.head + i) % ringdepth];
+			if ((f->Timestamp() >= begin) && (f->Timestamp() <= end))
+			{
+				out.push_back(f);
+				n++;
+			}
+		}
+
+		return n;
+	}
+
+	/**
+	 * Description: latest "n" retained frames of stream "tid", oldest first, appended to
+					"out". return count appended.
+	 */
+	unsigned int Last(unsigned int tid, unsigned int n, std::vector<ISmartFramePtr> &out)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		std::map<unsigned int, LookbackRing>::iterator it = rings.find(tid);
+		if (it == rings.end())
+			return 0;
+
+		LookbackRing &ring = it->second;
+		n = std::min(n, ring.count);
+		for (unsigned int i = ring.count - n; i < ring.count; i++)
+			out.push_back(ring.slots[(ring.head + i) % ringdepth]);
+
+		return n;
+	}
+
+	/**
+	 * Description: release every retained frame
+	 */
+	void Clear()
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		rings.clear();
+		bytes	= 0;
+		frames	= 0;
+	}
+
+	inline unsigned long long Bytes()
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		return bytes;
+	}
+
+	inline unsigned int Frames()
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		return frames;
+	}
+
+private:
+	struct LookbackRing
+	{
+		std::vector<ISmartFramePtr>	slots;		/* ring of "ringdepth" frames */
+		unsigned int				head;		/* oldest frame */
+		unsigned int				count;		/* retained frames */
+		unsigned long long			bytes;		/* retained bytes */
+		unsigned int				offered;	/* frames offered, for decimation */
+
+		LookbackRing() : head(0), count(0), bytes(0), offered(0) {}
+	};
+
+	static inline unsigned long long Bytes(ISmartFramePtr &frame)
+	{
+		/* nv12 device buffer */
+		return (unsigned long long)frame->Step() * frame->Height() * 3 / 2;
+	}
+
+	inline void PopOldest(LookbackRing &ring)
+	{
+		BOOST_ASSERT(ring.count);
+
+		ISmartFramePtr &f = ring.slots[ring.head];
+		unsigned long long len = Bytes(f);
+		f = NULL;
+
+		ring.head = (ring.head + 1) % ringdepth;
+		ring.count--;
+		ring.bytes -= len;
+		bytes -= len;
+		frames--;
+	}
+
+	inline LookbackRing * Largest()
+	{
+		LookbackRing *largest = NULL;
+		for (std::map<unsigned int, LookbackRing>::iterator it = rings.begin(); it != rings.end(); it++)
+		{
+			if (it->second.count && (!largest || (it->second.bytes > largest->bytes)))
+				largest = &it->second;
+		}
+
+		return largest;
+	}
+
+	inline void Drop(unsigned int tid)
+	{
+		std::map<unsigned int, LookbackRing>::iterator it = rings.find(tid);
+		if (it == rings.end())
+			return;
+
+		bytes	-= it->second.bytes;
+		frames	-= it->second.count;
+		rings.erase(it);
+	}
+
+private:
+	unsigned int							ringdepth;		/* frames kept per stream */
+	unsigned int							decim;			/* keep one of every "decim" frames */
+	unsigned long long						bytebudget;		/* bytes bound of all rings */
+	unsigned int							framebudget;	/* frames bound of all rings */
+	unsigned long long						bytes;			/* retained bytes */
+	unsigned int							frames;			/* retained frames */
+	boost::mutex							mtx;			/* lock for rings */
+	std::map<unsigned int, LookbackRing>	rings;			/* tid to ring */
+};
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <boost/thread/mutex.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <boost/assert.hpp>
+#include <string>
+#include <iostream>
+#include <new>
+
+#ifndef FRAME_META_SLOTS
+#define FRAME_META_SLOTS	8		/* metadata slots per frame */
+#endif
+
+#ifndef FRAME_META_BYTES
+#define FRAME_META_BYTES	128		/* inline bytes of each slot */
+#endif
+
+/**
+ * Description: fits a metadata slot, inline and aligned no stricter than the slot storage
+ */
+#define FRAME_META_FITS(T)	((sizeof(T) <= FRAME_META_BYTES) && \
+	(boost::alignment_of<T>::value <= boost::alignment_of<FrameMeta::SlotStorage>::value))
+
+/**
+ * Description: type tag of a metadata type, the address is unique per type
+ */
+template<class T>
+struct FrameMetaType
+{
+	static char tag;
+};
+
+template<class T>
+char FrameMetaType<T>::tag = 0;
+
+/**
+ * Description: process wide metadata slot registry, register each metadata type once at
+				startup, the returned slot id is used by every frame
+ */
+class FrameMetaRegistry
+{
+public:
+	typedef void(*MetaDestroy)(void *p);
+
+	static FrameMetaRegistry & Instance()
+	{
+		static FrameMetaRegistry registry;
+		return registry;
+	}
+
+	/**
+	 * Description: register metadata type T under "name", registering the same name again
+					returns the same slot. return -1 if all slots are taken.
+	 */
+	template<class T>
+	int Register(const std::string &name);
+
+	inline const char * Name(unsigned int slot)
+	{
+		BOOST_ASSERT(slot < FRAME_META_SLOTS);
+		return slots[slot].name.c_str();
+	}
+
+	inline bool Match(unsigned int slot, const void *tag)
+	{
+		return (slot < FRAME_META_SLOTS) && (slots[slot].tag == tag);
+	}
+
+	inline MetaDestroy Destroyer(unsigned int slot)
+	{
+		return slots[slot].destroy;
+	}
+
+private:
+	struct MetaSlot
+	{
+		std::string		name;		/* registered name */
+		const void *	tag;		/* FrameMetaType<T>::tag, NULL if free */
+		MetaDestroy		destroy;	/* destructor of T */
+
+		MetaSlot() : tag(NULL), destroy(NULL) {}
+	};
+
+	template<class T>
+	static void Destroy(void *p)
+	{
+		static_cast<T*>(p)->~T();
+	}
+
+	FrameMetaRegistry() {}
+
+	boost::mutex	mtx;						/* lock for registration */
+	MetaSlot		slots[FRAME_META_SLOTS];	/* registered slots */
+};
+
+/**
+ * Description: inline metadata of one frame. a slot is constructed on first Set and
+				destroyed by Reset when the frame returns to pool, no allocation happens
+				unless T allocates itself. a frame is worked on by one stage at a time,
+				slots are not locked.
+ */
+class FrameMeta
+{
+public:
+	union SlotStorage
+	{
+		char			bytes[FRAME_META_BYTES];
+		long double		align_ld;
+		long long		align_ll;
+		void *			align_p;
+	};
+
+	FrameMeta() : used(0) {}
+
+	~FrameMeta()
+	{
+		Reset();
+	}
+
+	/**
+	 * Description: metadata of "slot", NULL if not set on this frame
+	 */
+	template<class T>
+	inline T * Get(unsigned int slot)
+	{
+		BOOST_ASSERT(FrameMetaRegistry::Instance().Match(slot, &FrameMetaType<T>::tag));
+
+		return (used & (1u << slot)) ? reinterpret_cast<T*>(storage[slot].bytes) : NULL;
+	}
+
+	/**
+	 * Description: metadata of "slot", default constructed on first call
+	 */
+	template<class T>
+	inline T & Set(unsigned int slot)
+	{
+		BOOST_STATIC_ASSERT(FRAME_META_FITS(T));
+		BOOST_ASSERT(FrameMetaRegistry::Instance().Match(slot, &FrameMetaType<T>::tag));
+
+		if (!(used & (1u << slot)))
+		{
+			new (storage[slot].bytes) T();
+			used |= (1u << slot);
+		}
+
+		return *reinterpret_cast<T*>(storage[slot].bytes);
+	}
+
+	template<class T>
+	inline T & Set(unsigned int slot, const T &value)
+	{
+		return (Set<T>(slot) = value);
+	}
+
+	inline bool Has(unsigned int slot)
+	{
+		return (used & (1u << slot)) != 0;
+	}
+
+	/**
+	 * Description: destroy "slot" if set
+	 */
+	inline void Clear(unsigned int slot)
+	{
+		if (used & (1u << slot))
+		{
+			FrameMetaRegistry::Instance().Destroyer(slot)(storage[slot].bytes);
+			used &= ~(1u << slot);
+		}
+	}
+
+	/**
+	 * Description: destroy all slots, called when the frame returns to pool
+	 */
+	inline void Reset()
+	{
+		for (unsigned int slot = 0; used && (slot < FRAME_META_SLOTS); slot++)
+			Clear(slot);
+	}
+
+private:
+	BOOST_STATIC_ASSERT(FRAME_META_SLOTS <= 32);
+
+	unsigned int	used;						/* bit mask of set slots */
+	SlotStorage		storage[FRAME_META_SLOTS];	/* inline slot buffers */
+};
+
+template<class T>
+int FrameMetaRegistry::Register(const std::string &name)
+{
+	BOOST_STATIC_ASSERT(FRAME_META_FITS(T));
+
+	boost::lock_guard<boost::mutex> lock(mtx);
+
+	for (int i = 0; i < FRAME_META_SLOTS; i++)
+	{
+		if (slots[i].tag && (slots[i].name == name))
+		{
+			/* same name must be the same type */
+			BOOST_ASSERT(slots[i].tag == &FrameMetaType<T>::tag);
+			return (slots[i].tag == &FrameMetaType<T>::tag) ? i : -1;
+		}
+	}
+
+	for (int i = 0; i < FRAME_META_SLOTS; i++)
+	{
+		if (!slots[i].tag)
+		{
+			slots[i].name		= name;
+			slots[i].destroy	= Destroy<T>;
+			slots[i].tag		= &FrameMetaType<T>::tag;
+			return i;
+		}
+	}
+
+	std::cout << "[warning] no free frame metadata slot for " << name << ". err(" << FRAME_META_SLOTS << ")" << std::endl;
+	return -1;
+}
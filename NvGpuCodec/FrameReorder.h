@@ -0,0 +1,279 @@
+#pragma once
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <map>
+#include "SmartFrame.h"
+
+using namespace std;
+
+/**
+ * Description: per-stream reorder buffer. frames of the same stream(Tid) are released
+				in FrameNo order, FrameNo starts from 0 for each stream(see FrameBatchPipe).
+				a gap caused by dropped frames is skipped when reorder window is full or
+				when the first frame waiting for the gap has waited longer than time_out.
+				frames arrive later than their skipped gap are dropped. a last frame arriving
+				early ends the stream once the frames before it are released or skipped, the
+				ended stream is remembered for time_out to drop frames arriving after it.
+				roi views share FrameNo with their parent and pass through unordered.
+ */
+class FrameReorder
+{
+public:
+	typedef void(*ReorderRoutine)(ISmartFramePtr frame, void *user);
+
+	FrameReorder(ReorderRoutine rroutine	/* in order frame callback */,
+		void *				user = 0		/* callback pointer */,
+		unsigned int		window = 16		/* max pending frames per stream */,
+		unsigned int		time_out = 100	/* millisecond */)
+		: rcb(rroutine), cbv(user), pending(0), ended(0), skipped(0), late(0)
+	{
+		BOOST_ASSERT(rroutine);
+
+		wnd		= max(window, 1u);
+		timeout = boost::chrono::milliseconds(max(time_out, 1u));
+	}
+
+	~FrameReorder()
+	{
+		Flush();
+	}
+
+	/**
+	 * Description: input a frame, the callback is invoked for every frame becomes in order.
+					callback is invoked with reorder lock held, it should be short.
+	 */
+	void Push(ISmartFramePtr frame)
+	{
+		Accept(frame, true);
+	}
+
+	/**
+	 * Description: the frame was dropped upstream, its number is released without callback
+					so following frames do not wait for it
+	 */
+	void Discard(ISmartFramePtr frame)
+	{
+		Accept(frame, false);
+	}
+
+	/**
+	 * Description: skip gaps which have waited longer than time_out, call it periodically
+	 */
+	void Expire()
+	{
+		if (!pending && !ended) return;
+
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+		for (std::map<unsigned int, ReorderStream>::iterator it = streams.begin(); it != streams.end();)
+		{
+			while (it->second.frames.size() && ((now - it->second.since) > timeout))
+			{
+				Skip(it->second);
+				Drain(it->second);
+			}
+			End(it->second);
+
+			if (Done(it->second) && ((now - it->second.since) > timeout))
+			{
+				/* late frames of an ended stream had their time */
+				ended--;
+				streams.erase(it++);
+			}
+			else
+			{
+				it++;
+			}
+		}
+	}
+
+	/**
+	 * Description: release all pending frames in order
+	 */
+	void Flush()
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		for (std::map<unsigned int, ReorderStream>::iterator it = streams.begin(); it != streams.end(); it++)
+		{
+			while (it->second.frames.size())
+			{
+				Skip(it->second);
+				Drain(it->second);
+			}
+
+			End(it->second);
+		}
+	}
+
+	/**
+	 * Description: drop all pending frames without releasing them downstream
+	 */
+	void Clear()
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		streams.clear();
+		pending = 0;
+		ended	= 0;
+	}
+
+	inline unsigned int Pending()			{ return pending; }	/* frames waiting for gaps */
+	inline unsigned long long Skipped()		{ return skipped; }	/* frame numbers given up */
+	inline unsigned long long Late()		{ return late; }	/* frames dropped for arriving after skip */
+
+private:
+	struct ReorderStream
+	{
+		unsigned int								expect;	/* next frame number to release */
+		boost::chrono::steady_clock::time_point		since;	/* when the current gap started, or the stream ended */
+		std::map<unsigned int, ISmartFramePtr>		frames;	/* out of order frames */
+		bool										last;	/* last frame seen */
+		unsigned int								end;	/* frame number of last frame */
+		bool										done;	/* every frame up to last released or skipped */
+
+		ReorderStream() : expect(0), last(false), end(0), done(false) {}
+	};
+
+	void Accept(ISmartFramePtr frame, bool emit)
+	{
+		BOOST_ASSERT(frame);
+
+		if (frame->Parent())
+		{
+			/**
+			 * Description: views are not numbered on their own
+			 */
+			if (emit) rcb(frame, cbv);
+			return;
+		}
+
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		ReorderStream & s = streams[frame->Tid()];
+		unsigned int no = frame->FrameNo();
+
+		if (no < s.expect)
+		{
+			/**
+			 * Description: gap already skipped, drop
+			 */
+			if (emit) late++;
+			return;
+		}
+
+		if (frame->LastFrame() && !s.last)
+		{
+			/* the stream ends here, frames before it may still arrive */
+			s.last	= true;
+			s.end	= no;
+		}
+
+		/* discarded frame is kept as an empty placeholder */
+		ISmartFramePtr slot(emit ? frame : ISmartFramePtr());
+
+		if (no == s.expect)
+		{
+			Emit(s, no, slot);
+		}
+		else
+		{
+			if (s.frames.empty())
+				s.since = boost::chrono::steady_clock::now();
+
+			s.frames.insert(std::pair<unsigned int, ISmartFramePtr>(no, slot));
+			pending++;
+
+			if (s.frames.size() > wnd)
+			{
+				/**
+				 * Description: reorder window is full, skip the gap
+				 */
+				Skip(s);
+			}
+		}
+
+		Drain(s);
+		End(s);
+	}
+
+	/**
+	 * Description: stream released its last frame, anything pending beyond it is flushed and
+					the stream is kept for time_out to drop late frames
+	 */
+	inline void End(ReorderStream &s)
+	{
+		if (!s.last || s.done || (s.expect <= s.end))
+			return;
+
+		while (s.frames.size())
+		{
+			Skip(s);
+			Drain(s);
+		}
+
+		s.done	= true;
+		s.since	= boost::chrono::steady_clock::now();
+		ended++;
+	}
+
+	inline bool Done(ReorderStream &s)
+	{
+		return s.done && s.frames.empty();
+	}
+
+	inline void Emit(ReorderStream &s, unsigned int no, ISmartFramePtr &frame)
+	{
+		s.expect = no + 1;
+		if (frame) rcb(frame, cbv);
+	}
+
+	inline void Skip(ReorderStream &s)
+	{
+		/**
+		 * Description: give up waiting, jump to the first pending frame
+		 */
+		unsigned int no = s.frames.begin()->first;
+		skipped += (no - s.expect);
+		s.expect = no;
+	}
+
+	inline void Drain(ReorderStream &s)
+	{
+		/**
+		 * Description: release consecutive pending frames
+		 */
+		bool moved = false;
+
+		std::map<unsigned int, ISmartFramePtr>::iterator it = s.frames.begin();
+		while ((it != s.frames.end()) && (it->first == s.expect))
+		{
+			unsigned int no = it->first;
+			ISmartFramePtr frame = it->second;
+			s.frames.erase(it++);
+			pending--;
+			moved = true;
+
+			Emit(s, no, frame);
+		}
+
+		/* remaining frames start waiting for a new gap */
+		if (moved && s.frames.size())
+			s.since = boost::chrono::steady_clock::now();
+	}
+
+private:
+	ReorderRoutine							rcb;		/* in order frame callback */
+	void *									cbv;		/* callback pointer */
+	unsigned int							wnd;		/* reorder window per stream */
+	boost::chrono::milliseconds				timeout;	/* gap timeout */
+	boost::mutex							mtx;		/* lock for streams */
+	std::map<unsigned int, ReorderStream>	streams;	/* tid to reorder stream */
+	boost::atomic_uint32_t					pending;	/* total pending frames */
+	boost::atomic_uint32_t					ended;		/* ended streams kept for late frames */
+	boost::atomic_uint64_t					skipped;	/* skipped frame numbers */
+	boost::atomic_uint64_t					late;		/* dropped late frames */
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <iostream>
+#include <map>
+#include "SmartFrame.h"
+#include "StageMetrics.h"
+
+using namespace std;
+
+/**
+ * Description: why a frame was shed
+ */
+enum ShedReason
+{
+	SRDeadline = 0,		/* stage skipped a frame which could not meet its deadline */
+	SROldest = 1,		/* entry queue overflow, oldest frames dropped */
+	SRPriority = 2,		/* entry queue overflow, frames of lowest priority stream dropped */
+	SRMax
+};
+
+/**
+ * Description: which frames go first when the entry queue overflows
+ */
+enum ShedOrder
+{
+	SOOldestFirst = 0,
+	SOLowPriorityFirst = 1,
+};
+
+/**
+ * Description: load shedding policy. a frame's deadline is its capture timestamp plus
+				"budget", capture timestamps are mapped to local clock per stream by the
+				smallest capture-to-arrival offset seen, so any timestamp epoch works.
+ */
+struct ShedPolicy
+{
+	unsigned int	budget;		/* end to end latency budget, millisecond, 0 disables deadline shedding */
+	unsigned int	maxqueue;	/* entry queue bound in frames, 0 disables batch shedding */
+	ShedOrder		order;		/* overflow shedding order */
+	double			tsrate;		/* timestamp ticks per microsecond */
+
+	ShedPolicy(unsigned int _budget = 200, unsigned int _maxqueue = 0, ShedOrder _order = SOOldestFirst)
+		: budget(_budget), maxqueue(_maxqueue), order(_order)
+	{
+		/* decoders stamp frames with system clock ticks */
+		tsrate = (double)boost::chrono::system_clock::period::den / boost::chrono::system_clock::period::num / 1000000.0;
+	}
+};
+
+/**
+ * Description: stage level load shedder. stages ask Admit before working on a frame, a frame
+				is shed when now plus the estimated service time of the remaining stages is
+				past its deadline. shed counts are kept for each reason.
+ */
+class LoadShedder
+{
+public:
+	LoadShedder(unsigned int stages, const ShedPolicy &p) : stagecnt(stages), policy(p)
+	{
+		BOOST_ASSERT(stages > 0);
+		BOOST_ASSERT(p.tsrate > 0);
+
+		estimate = new boost::atomic_uint32_t[stagecnt];
+		for (int i = 0; i < stagecnt; i++)
+			estimate[i] = 0;
+
+		for (int i = 0; i < SRMax; i++)
+			shed[i] = 0;
+	}
+
+	~LoadShedder()
+	{
+		delete[] estimate;
+		estimate = NULL;
+	}
+
+	/**
+	 * Description: priority of stream "tid", bigger is more important, default 0
+	 */
+	void Priority(unsigned int tid, int priority)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		streams[tid].priority = priority;
+	}
+
+	int Priority(unsigned int tid)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		std::map<unsigned int, ShedStream>::iterator it = streams.find(tid);
+		return (it != streams.end()) ? it->second.priority : 0;
+	}
+
+	/**
+	 * Description: observe a frame entering the pipeline, learns capture to local clock offset
+	 */
+	void Stamp(ISmartFramePtr frame)
+	{
+		long long offset = (long long)MetricsClock() - Capture(frame);
+
+		boost::lock_guard<boost::mutex> lock(mtx);
+		ShedStream &s = streams[frame->Tid()];
+		if (!s.anchored || (offset < s.offset))
+		{
+			s.offset	= offset;
+			s.anchored	= true;
+		}
+	}
+
+	/**
+	 * Description: deadline of a frame in MetricsClock microseconds, 0 if stream never stamped
+	 */
+	unsigned long long Deadline(ISmartFramePtr frame)
+	{
+		long long offset = 0;
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			std::map<unsigned int, ShedStream>::iterator it = streams.find(frame->Tid());
+			if ((it == streams.end()) || !it->second.anchored)
+				return 0;
+			offset = it->second.offset;
+		}
+
+		return (unsigned long long)(Capture(frame) + offset) + policy.budget * 1000ULL;
+	}
+
+	/**
+	 * Description: feed service time of stage "s", kept as a moving average
+	 */
+	inline void Served(unsigned int s, unsigned long long us)
+	{
+		unsigned int est = estimate[s];
+		estimate[s] = est ? (unsigned int)(est + ((long long)us - (long long)est) / 8) : (unsigned int)max(us, 1ULL);
+	}
+
+	/**
+	 * Description: true if stage "s" should work on the frame, otherwise the caller drops
+					it and counts it with Shed(SRDeadline). last frames are never shed.
+	 */
+	bool Admit(unsigned int s, ISmartFramePtr frame)
+	{
+		if (!policy.budget || frame->LastFrame())
+			return true;
+
+		unsigned long long deadline = Deadline(frame);
+		if (!deadline)
+			return true;
+
+		/**
+		 * Description: time still needed by this and following stages
+		 */
+		unsigned long long need = 0;
+		for (int i = s; i < stagecnt; i++)
+			need += estimate[i];
+
+		return (MetricsClock() + need) <= deadline;
+	}
+
+	inline void Shed(ShedReason reason, unsigned int n = 1)
+	{
+		shed[reason].fetch_add(n, boost::memory_order_relaxed);
+	}
+
+	inline unsigned long long Count(ShedReason reason) const
+	{
+		return shed[reason].load(boost::memory_order_relaxed);
+	}
+
+	inline const ShedPolicy & Policy()
+	{
+		return policy;
+	}
+
+	void Report()
+	{
+		std::cout << "[info] shed frames: deadline " << Count(SRDeadline) << ", oldest " << Count(SROldest)
+			<< ", priority " << Count(SRPriority) << std::endl;
+	}
+
+private:
+	struct ShedStream
+	{
+		int			priority;	/* stream priority */
+		long long	offset;		/* smallest arrival minus capture, microsecond */
+		bool		anchored;	/* offset is valid */
+
+		ShedStream() : priority(0), offset(0), anchored(false) {}
+	};
+
+	inline long long Capture(ISmartFramePtr &frame)
+	{
+		return (long long)(frame->Timestamp() / policy.tsrate);
+	}
+
+private:
+	unsigned int							stagecnt;		/* stage count */
+	ShedPolicy								policy;			/* shedding policy */
+	boost::atomic_uint32_t *				estimate;		/* service time estimation of each stage, microsecond */
+	boost::atomic_uint64_t					shed[SRMax];	/* shed frames of each reason */
+	boost::mutex							mtx;			/* lock for streams */
+	std::map<unsigned int, ShedStream>		streams;		/* tid to stream state */
+};
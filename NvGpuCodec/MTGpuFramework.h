@@ -15,9 +15,27 @@
 #include "DedicatedPool.h"
 #include "SmartFrame.h"
 #include "FFCodec.h"
+#include "FFDemux.h"
+#include "StageMetrics.h"
+#include "FrameMeta.h"
+#include "ColorConvert.h"
+#include "FrameLookback.h"
+#include "ClipBatch.h"
+
+#define FRAME_DERIVE_MAX	4	/* cached color space derivatives per frame */
+#define FRAME_HOLD_HISTORY	8	/* latest stage hand-offs kept per frame */
 
 using namespace boost;
 
+/* bound of waiting for frames and buffers on destruction, millisecond */
+const unsigned int DrainTimeout = 5000;
+
+/* bound of a decoder waiting for queue room or surfaces before dropping a picture, millisecond */
+const unsigned int DecodeQueueWait = 1000;
+
+/* least interval between two residency reports of a stalled pool, millisecond */
+const unsigned int StallReportInterval = 1000;
+
 class SmartPoolInterface
 {
 public:
@@ -26,13 +44,36 @@ public:
 	virtual ~SmartPoolInterface() {};
 };
 
+/**
+ * Description: host side resources shared by frames of one pool
+ */
+struct SmartFrameShared
+{
+	HostPool				hostpool;		/* host mirror buffers */
+	HostPool				derivepool;		/* color space derivative buffers */
+	boost::atomic_uint64_t	derivebytes;	/* derivative bytes in use */
+	unsigned long long		derivebudget;	/* derivative bytes bound */
+	void *					cudactx;		/* context made current for download */
+
+	SmartFrameShared(unsigned int frames, unsigned long long budget, void *cuctx)
+		: hostpool(frames), derivepool(frames * FRAME_DERIVE_MAX), derivebytes(0), derivebudget(budget), cudactx(cuctx)
+	{
+	}
+};
+
 class SmartFrame : public ISmartFrame
 {
 public:
-	explicit SmartFrame(SmartPoolInterface *fpool)
-		:refcnt(0), sfpool(fpool), last(false)
+	explicit SmartFrame(SmartPoolInterface *fpool, SmartFrameShared *res = NULL)
+		:refcnt(0), sfpool(fpool), last(false), ready(NULL), holder(NULL), acquired(0), holdpos(0), host(NULL), shared(res)
 	{
 		BOOST_ASSERT(sfpool);
+
+		for (int i = 0; i < FRAME_HOLD_HISTORY; i++)
+		{
+			holdstage[i] = NULL;
+			holdhist[i] = 0;
+		}
 	}
 
 	~SmartFrame()
@@ -45,6 +86,149 @@ public:
 		return origindata;
 	}
 
+	inline unsigned char* Chroma()
+	{
+		return chroma;
+	}
+
+	inline ISmartFrame * Parent()
+	{
+		return parent.get();
+	}
+
+	/**
+	 * Description: host mirror, the first caller downloads the frame into a HostPool buffer,
+					concurrent callers wait for it, later callers reuse it until the frame
+					returns to pool. return NULL if download failed.
+	 */
+	unsigned char* Host()
+	{
+		unsigned char *h = host.load(boost::memory_order_acquire);
+		if (h) return h;
+
+		BOOST_ASSERT(shared);
+
+		boost::lock_guard<boost::mutex> lock(hostmtx);
+		if (!(h = host.load(boost::memory_order_relaxed)))
+		{
+			unsigned int lumalen = width * height;
+			h = shared->hostpool.Alloc(lumalen + (lumalen >> 1));
+			if (!h)
+			{
+				FORMAT_WARNING("alloc host mirror failed", lumalen);
+				return NULL;
+			}
+
+			if (shared->cudactx) cuCtxPushCurrent((CUcontext)shared->cudactx);
+
+			int ret = ready ? cudaEventSynchronize((cudaEvent_t)ready) : 0;
+			if (!ret)
+				ret = cudaMemcpy2D(h, width, origindata, step, width, height, cudaMemcpyDeviceToHost);
+			if (!ret)
+				ret = cudaMemcpy2D(h + lumalen, width, chroma, step, width, height >> 1, cudaMemcpyDeviceToHost);
+
+			if (shared->cudactx) cuCtxPopCurrent(NULL);
+
+			if (ret)
+			{
+				FORMAT_WARNING("download host mirror failed", ret);
+				shared->hostpool.Free(h);
+				return NULL;
+			}
+
+			host.store(h, boost::memory_order_release);
+		}
+
+		return h;
+	}
+
+	/**
+	 * Description: color space derivative computed on cpu from the host mirror on first
+					request, later requests of the same color space and size get the cached
+					one until the frame returns to pool. return NULL if the pool derivative
+					budget or the per-frame derivative count is exceeded.
+	 */
+	const PCC_Frame * Derive(PCC_ColorSpace cs, unsigned int w = 0, unsigned int h = 0)
+	{
+		BOOST_ASSERT(shared);
+
+		if (!w) w = width;
+		if (!h) h = height;
+
+		boost::lock_guard<boost::mutex> lock(derivemtx);
+
+		int idx = -1;
+		for (int i = 0; i < FRAME_DERIVE_MAX; i++)
+		{
+			if (!derived[i].buf)
+			{
+				if (idx < 0) idx = i;
+				continue;
+			}
+
+			if ((derived[i].frame.colorSpace == cs) && (derived[i].frame.width == w) && (derived[i].frame.height == h))
+				return &derived[i].frame;
+		}
+
+		if (idx < 0)
+		{
+			FORMAT_WARNING("too many derivatives on one frame", FRAME_DERIVE_MAX);
+			return NULL;
+		}
+
+		unsigned int len = ColorConvert::Size(cs, w, h);
+		if (!len)
+			return NULL;
+
+		if ((shared->derivebytes += len) > shared->derivebudget)
+		{
+			/* over budget, caller converts on its own */
+			shared->derivebytes -= len;
+			return NULL;
+		}
+
+		unsigned char *src = Host();
+		unsigned char *buf = src ? shared->derivepool.Alloc(len) : NULL;
+		if (!buf)
+		{
+			shared->derivebytes -= len;
+			return NULL;
+		}
+
+		if (!ColorConvert::FromNv12(src, src + width * height, width, height, width, cs, w, h, buf, derived[idx].frame))
+		{
+			shared->derivepool.Free(buf);
+			shared->derivebytes -= len;
+			return NULL;
+		}
+
+		derived[idx].frame.timeStamp	= timestamp;
+		derived[idx].buf				= buf;
+		derived[idx].len				= len;
+
+		return &derived[idx].frame;
+	}
+
+	/**
+	 * Description: release host mirror and derivatives, called when the frame returns to pool
+	 */
+	inline void DropHost()
+	{
+		for (int i = 0; i < FRAME_DERIVE_MAX; i++)
+		{
+			if (derived[i].buf)
+			{
+				shared->derivepool.Free(derived[i].buf);
+				shared->derivebytes -= derived[i].len;
+				derived[i].buf = NULL;
+				derived[i].len = 0;
+			}
+		}
+
+		unsigned char *h = host.exchange(NULL);
+		if (h) shared->hostpool.Free(h);
+	}
+
 	inline unsigned int Width()
 	{
 		return width;
@@ -80,6 +264,48 @@ public:
 		return timestamp;
 	}
 
+	inline void* Ready()
+	{
+		return ready;
+	}
+
+	inline FrameMeta * Meta()
+	{
+		return &meta;
+	}
+
+	inline void Hold(const char *stage)
+	{
+		holder.store(stage, boost::memory_order_relaxed);
+		Track(stage);
+	}
+
+	/**
+	 * Description: start residency bookkeeping, called when the frame leaves pool
+	 */
+	inline void Acquire(const char *stage)
+	{
+		for (int i = 0; i < FRAME_HOLD_HISTORY; i++)
+			holdhist[i].store(0, boost::memory_order_relaxed);
+		holdpos.store(0, boost::memory_order_relaxed);
+
+		holder.store(stage, boost::memory_order_relaxed);
+		acquired.store(MetricsClock(), boost::memory_order_relaxed);
+		Track(stage);
+	}
+
+	/**
+	 * Description: record a hand-off to "stage" with the reference count, relaxed stores in
+					a ring, the report tolerates entries torn by concurrent hand-offs.
+					reference changes themselves are not tracked, they are too frequent.
+	 */
+	inline void Track(const char *stage)
+	{
+		unsigned int i = holdpos.fetch_add(1, boost::memory_order_relaxed) % FRAME_HOLD_HISTORY;
+		holdstage[i].store(stage, boost::memory_order_relaxed);
+		holdhist[i].store(((MetricsClock() / 1000) << 16) | min(refcnt.load(boost::memory_order_relaxed), 0xFFFFu), boost::memory_order_relaxed);
+	}
+
 	inline unsigned int GetRef() const
 	{
 		unsigned int nnn = this->refcnt.load();
@@ -99,6 +325,8 @@ public:
 	inline void release(ISmartFrame * sf)
 	{
 		SmartFrame *ptr = static_cast<SmartFrame*>(sf);
+
+		/* frame is not touched after a decrement which did not release it, another holder may recycle it */
 		if ((--ptr->refcnt == 0) && (ptr->sfpool))
 		{
 			ptr->sfpool->Put(sf);
@@ -114,17 +342,183 @@ public:
 	volatile unsigned int	tid;
 	volatile unsigned long long timestamp;
 	volatile bool			last;
+	void *					ready;			/* cudaEvent_t completing device data, owned by decoder, NULL if complete */
 
 	BaseCodec*		decoder;
 
 	volatile unsigned int	batchidx;		/* identify batch sequence */
+	unsigned int			slot;			/* index in SmartFramePool */
+	FrameMeta				meta;			/* stage metadata, reset on return to pool */
+	unsigned char *			chroma;			/* uv plane */
+	ISmartFramePtr			parent;			/* roi view keeps its parent alive, NULL for full frame */
+	unsigned long long		inputclock;		/* when frame entered batch pipe, MetricsClock */
+
+	/**
+	 * Description: residency bookkeeping, read by SmartFramePool::Residency
+	 */
+	boost::atomic<const char*>	holder;		/* stage holding the frame, NULL if in pool */
+	boost::atomic_uint64_t	acquired;		/* when frame left pool, MetricsClock, 0 if in pool */
+	boost::atomic<const char*>	holdstage[FRAME_HOLD_HISTORY];	/* stages of latest hand-offs */
+	boost::atomic_uint64_t	holdhist[FRAME_HOLD_HISTORY];	/* hand-offs, MetricsClock ms << 16 | reference count */
+	boost::atomic_uint32_t	holdpos;		/* next holdhist entry */
 
 private:
+	boost::atomic<unsigned char*>	host;	/* host mirror, NULL until first Host call */
+	boost::mutex			hostmtx;		/* serializes the download */
+	SmartFrameShared *		shared;			/* host buffers and context of the pool */
+
+	struct FrameDerived
+	{
+		PCC_Frame		frame;	/* derivative description */
+		unsigned char *	buf;	/* derivepool buffer, NULL if unused */
+		unsigned int	len;	/* budget charged */
+
+		FrameDerived() : buf(NULL), len(0) {}
+	};
+	boost::mutex			derivemtx;		/* serializes conversions */
+	FrameDerived			derived[FRAME_DERIVE_MAX];	/* cached derivatives */
+
 	boost::atomic_uint32_t	refcnt;
 	SmartPoolInterface	*	sfpool;
 };
 
 
+/**
+ * Description: storage of a FrameBatchDesc, one block of pinned host memory mapped to the
+				device, grown to the largest batch seen. falls back to pageable memory
+				without a device view if mapping fails.
+ */
+class FrameBatchStore
+{
+public:
+	FrameBatchStore() : capacity(0), block(NULL), pinned(false)
+	{
+		memset(&desc, 0, sizeof(desc));
+		memset(&device, 0, sizeof(device));
+	}
+
+	~FrameBatchStore()
+	{
+		Free();
+	}
+
+	/**
+	 * Description: describe "len" frames of "p", one pass reading frame fields directly.
+					"cudactx" is made current to allocate the mapped block, NULL uses the
+					current one.
+	 */
+	const FrameBatchDesc & Fill(ISmartFramePtr *p, unsigned int len, void *cudactx = NULL)
+	{
+		if ((capacity < len) && !Grow(len, cudactx))
+		{
+			desc.count = 0;
+			return desc;
+		}
+
+		for (unsigned int i = 0; i < len; i++)
+		{
+			SmartFrame *f = static_cast<SmartFrame*>(p[i].get());
+			desc.luma[i]		= f ? f->origindata : NULL;
+			desc.chroma[i]		= f ? f->chroma : NULL;
+			desc.width[i]		= f ? f->width : 0;
+			desc.height[i]		= f ? f->height : 0;
+			desc.step[i]		= f ? f->step : 0;
+			desc.timestamp[i]	= f ? f->timestamp : 0;
+			desc.tid[i]			= f ? f->tid : 0;
+			desc.frameno[i]		= f ? f->frameno : 0;
+			desc.ready[i]		= f ? f->ready : NULL;
+		}
+
+		desc.count		= len;
+		device.count	= len;
+
+		return desc;
+	}
+
+private:
+	/* bytes of one entry across all arrays, pointer and 64 bit arrays first to stay aligned */
+	static const unsigned int EntryBytes = 3 * sizeof(void*) + sizeof(unsigned long long) + 5 * sizeof(unsigned int);
+
+	bool Grow(unsigned int len, void *cudactx)
+	{
+		Free();
+
+		size_t bytes = (size_t)EntryBytes * len;
+		void *dev = NULL;
+
+		if (cudactx) cuCtxPushCurrent((CUcontext)cudactx);
+
+		int ret = cudaHostAlloc(&block, bytes, cudaHostAllocMapped | cudaHostAllocPortable);
+		if (!ret && (ret = cudaHostGetDevicePointer(&dev, block, 0)))
+		{
+			cudaFreeHost(block);
+			block = NULL;
+		}
+
+		if (cudactx) cuCtxPopCurrent(NULL);
+
+		pinned = !ret;
+		if (!pinned)
+		{
+			FORMAT_WARNING("map batch descriptor failed, device view unavailable", ret);
+
+			dev = NULL;
+			if (!(block = ::malloc(bytes)))
+				return false;
+		}
+
+		Layout(desc, block, len);
+		Layout(device, dev, len);
+		desc.mapped		= dev ? &device : NULL;
+		device.mapped	= NULL;
+		capacity		= len;
+
+		return true;
+	}
+
+	void Free()
+	{
+		if (block)
+		{
+			if (pinned)
+				cudaFreeHost(block);
+			else
+				::free(block);
+		}
+
+		block		= NULL;
+		capacity	= 0;
+	}
+
+	static void Layout(FrameBatchDesc &d, void *base, unsigned int len)
+	{
+		unsigned char *b = (unsigned char*)base;
+		if (!b)
+		{
+			memset(&d, 0, sizeof(d));
+			return;
+		}
+
+		d.luma		= (unsigned char**)b;		b += len * sizeof(void*);
+		d.chroma	= (unsigned char**)b;		b += len * sizeof(void*);
+		d.ready		= (void**)b;				b += len * sizeof(void*);
+		d.timestamp	= (unsigned long long*)b;	b += len * sizeof(unsigned long long);
+		d.width		= (unsigned int*)b;			b += len * sizeof(unsigned int);
+		d.height	= (unsigned int*)b;			b += len * sizeof(unsigned int);
+		d.step		= (unsigned int*)b;			b += len * sizeof(unsigned int);
+		d.tid		= (unsigned int*)b;			b += len * sizeof(unsigned int);
+		d.frameno	= (unsigned int*)b;
+	}
+
+private:
+	FrameBatchDesc		desc;		/* host view */
+	FrameBatchDesc		device;		/* device view of the same block */
+	unsigned int		capacity;	/* entries the block holds */
+	void *				block;		/* arrays, pinned and mapped unless "pinned" is false */
+	bool				pinned;		/* block is from cudaHostAlloc */
+};
+
+
 class IFrameRestore
 {
 public:
@@ -133,42 +527,54 @@ public:
 
 
 /**
-* Description: fixed size smart frame pool
+* Description: fixed size smart frame pool. frames are preallocated and kept in a lock-free
+stack of slot indexes, the head carries a tag against ABA. Get blocks at most
+"wait_timeout" ms when the pool is exhausted.
 */
 class SmartFramePool : public SmartPoolInterface
 {
 public:
-	SmartFramePool(IFrameRestore* prestore, unsigned int poolsize = 1024) :quit(false), totalsize(poolsize), pres(prestore)
+	SmartFramePool(IFrameRestore* prestore, unsigned int poolsize = 1024, unsigned int wait_timeout = 1000, void *cuctx = NULL,
+		unsigned long long derive_budget = (256ULL << 20) /* bytes of color space derivatives */,
+		unsigned int stall_threshold = 100 /* millisecond, Get waiting longer reports residency, 0 disables */)
+		:quit(false), totalsize(poolsize), pres(prestore), waitms(wait_timeout), busy(0), waiters(0), head(FreeHead(0, SlotNil))
+		, shared(poolsize, derive_budget, cuctx), stallms(stall_threshold), lastreport(0)
 	{
 		BOOST_ASSERT(totalsize > 0);
+		BOOST_ASSERT(totalsize < SlotNil);
 
-		freefrms.clear();
-		busyfrms.clear();
+		frames	= new SmartFrame *[totalsize];
+		next	= new boost::atomic_uint32_t[totalsize];
+
+		for (unsigned int i = 0; i < totalsize; i++)
+		{
+			frames[i] = new SmartFrame(this, &shared);
+			frames[i]->slot = i;
+		}
+
+		for (unsigned int i = totalsize; i > 0; i--)
+			Push(i - 1);
 	}
 
 	~SmartFramePool()
 	{
 		/**
-		* Description: cleanup pool items
+		* Description: cleanup pool items, frames still referenced are abandoned
 		*/
-		quit = true;
-
-		do
-		{
-			/**
-			* Description: wait for frames freed
-			*/
-			boost::this_thread::sleep(boost::posix_time::microseconds(1000));
-		} while (BusySize());
+		Drain(DrainTimeout);
 
-		typedef std::vector<ISmartFrame*>::iterator VITer;
-		for (VITer it = freefrms.begin(); it != freefrms.end(); it++)
+		unsigned int slot = SlotNil;
+		while ((slot = Pop()) != SlotNil)
 		{
-			ISmartFrame *p = *it;
-			delete p;
-			p = NULL;
+			delete frames[slot];
+			frames[slot] = NULL;
 		}
-		freefrms.clear();
+
+		delete[] frames;
+		frames = NULL;
+
+		delete[] next;
+		next = NULL;
 	}
 
 	inline int Put(ISmartFrame *sf)
@@ -176,72 +582,301 @@ public:
 		/**
 		* Description: remove bind to thumbnail buffer
 		*/
-		pres->Return((SmartFrame*)sf);
-		boost::lock_guard<boost::recursive_mutex> lock(mtx);
-		freefrms.push_back(sf);
-		busyfrms.erase(sf);
+		SmartFrame *frame = static_cast<SmartFrame*>(sf);
+		if (frame->parent)
+		{
+			/* roi view owns no buffer, drop parent reference, which may return the parent */
+			frame->parent.reset();
+		}
+		else
+		{
+			pres->Return(frame);
+		}
+		frame->meta.Reset();
+		frame->DropHost();
+		frame->ready = NULL;
+		frame->acquired.store(0, boost::memory_order_relaxed);
+		frame->holder.store(NULL, boost::memory_order_relaxed);
+
+		Push(static_cast<SmartFrame*>(sf)->slot);
+		Unbusy();
 
 		return 0;
 	}
 
 	inline ISmartFrame * Get(unsigned int tid/* who is acquiring frame */)
 	{
+		/* counted before quit is checked, Drain does not see 0 while a frame is handed out */
+		busy++;
+
 		if (quit)
 		{
-			BOOST_ASSERT(false);
+			/* draining, no more frames */
+			Unbusy();
 			return NULL;
 		}
 
-		ISmartFrame * sf = NULL;
-
-		do
+		unsigned int slot = Pop();
+		if (slot == SlotNil)
 		{
+			/**
+			* Description: pool exhausted, wait for a frame returned
+			*/
+			boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+			boost::chrono::steady_clock::time_point deadline = start + boost::chrono::milliseconds(waitms);
+			boost::chrono::steady_clock::time_point stallat = start + boost::chrono::milliseconds(stallms);
+			bool stalled = !stallms || (stallat >= deadline);
+
+			waiters++;
 			{
-				/**
-				* Description: acquire frame
-				*/
-				boost::lock_guard<boost::recursive_mutex> lock(mtx);
-				if (freefrms.size())
-				{
-					/**
-					* Description: have free frame
-					*/
-					sf = freefrms.back();
-					freefrms.pop_back();
-					busyfrms.insert(std::pair<ISmartFrame *, unsigned int>(sf, tid));
-					break;
-				}
-				else if ((freefrms.size() + busyfrms.size()) < totalsize)
+				boost::unique_lock<boost::mutex> lock(waitmtx);
+				while (((slot = Pop()) == SlotNil) && !quit)
 				{
-					/**
-					* Description: frame lower than pool limit size, create new one
-					*/
-					sf = new SmartFrame(this);
-					busyfrms.insert(std::pair<ISmartFrame *, unsigned int>(sf, tid));
-					break;
+					if (!stalled)
+					{
+						if (waitcv.wait_until(lock, stallat) == boost::cv_status::timeout)
+						{
+							/**
+							 * Description: waited too long, tell who holds the frames, without
+											the lock so Put is not blocked by the report
+							 */
+							stalled = true;
+							lock.unlock();
+							Stall("smart frame pool", stallms);
+							lock.lock();
+						}
+						continue;
+					}
+
+					if (waitcv.wait_until(lock, deadline) == boost::cv_status::timeout)
+					{
+						slot = Pop();
+						break;
+					}
 				}
 			}
+			waiters--;
 
-			/**
-			* Description: wait for free frame
-			*/
-			boost::this_thread::sleep(boost::posix_time::microseconds(200));
+			if (slot == SlotNil)
+			{
+				FORMAT_WARNING("smart frame pool exhausted", tid);
+				Unbusy();
+				return NULL;
+			}
+		}
+
+		frames[slot]->Acquire("decoder");
+		return frames[slot];
+	}
+
+	/**
+	 * Description: zero-copy region of interest view of "parent", shares parent's buffer and
+					keeps it referenced until the view is released. region is aligned down to
+					even coordinates for nv12 chroma and clipped to parent. views share
+					FrameNo and Tid with parent. return NULL if pool is exhausted.
+	 */
+	ISmartFrame * View(ISmartFramePtr parent, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+	{
+		BOOST_ASSERT(parent);
 
-		} while (!sf);
+		x &= ~1u;
+		y &= ~1u;
+		if ((x >= parent->Width()) || (y >= parent->Height()))
+			return NULL;
+
+		w = min(w, parent->Width() - x) & ~1u;
+		h = min(h, parent->Height() - y) & ~1u;
+		if (!w || !h)
+			return NULL;
 
-		return sf;
+		SmartFrame *view = static_cast<SmartFrame*>(Get(parent->Tid()));
+		if (!view)
+			return NULL;
+
+		unsigned int s		= parent->Step();
+		view->origindata	= parent->NV12() + y * s + x;
+		view->chroma		= parent->Chroma() + (y >> 1) * s + x;
+		view->width			= w;
+		view->height		= h;
+		view->step			= s;
+		view->frameno		= parent->FrameNo();
+		view->tid			= parent->Tid();
+		view->timestamp		= parent->Timestamp();
+		view->ready			= parent->Ready();
+		view->last			= false;
+		view->decoder		= NULL;
+		view->inputclock	= MetricsClock();
+		view->parent		= parent;
+		view->Hold("view owner");
+
+		return view;
 	}
 
 	inline unsigned int FreeSize()
 	{
-		boost::lock_guard<boost::recursive_mutex> lock(mtx);
-		return freefrms.size();
+		/* a Get waiting for a frame is counted busy */
+		unsigned int n = busy;
+		return (n < totalsize) ? (totalsize - n) : 0;
 	}
 
 	inline unsigned int BusySize()
 	{
-		boost::lock_guard<boost::recursive_mutex> lock(mtx);
-		return busyfrms.size();
+		return busy;
+	}
+
+	inline unsigned int TotalSize()
+	{
+		return totalsize;
+	}
+
+	/**
+	 * Description: report the "top" oldest frames out of pool, each with its age, holder
+					stage, reference count and latest stage hand-offs relative to acquire
+	 */
+	void Residency(unsigned int top = 8)
+	{
+		unsigned long long now = MetricsClock();
+
+		std::vector<std::pair<unsigned long long, unsigned int> > held;	/* acquire time, slot */
+		for (unsigned int i = 0; i < totalsize; i++)
+		{
+			unsigned long long t = frames[i]->acquired.load(boost::memory_order_relaxed);
+			if (t) held.push_back(std::make_pair(t, i));
+		}
+		std::sort(held.begin(), held.end());
+
+		std::cout << "[info] frame residency: " << held.size() << " of " << totalsize << " frames out of pool" << std::endl;
+
+		for (unsigned int i = 0; (i < top) && (i < held.size()); i++)
+		{
+			SmartFrame *f = frames[held[i].second];
+			const char *stage = f->holder.load(boost::memory_order_relaxed);
+			unsigned long long since = held[i].first / 1000;
+
+			std::cout << "[info]   slot " << held[i].second << ", tid " << f->tid << ", frame " << f->frameno
+				<< ", age " << (now - held[i].first) / 1000 << "ms, holder " << (stage ? stage : "unknown")
+				<< ", ref " << f->GetRef() << (f->parent ? ", view" : "") << ", hand-offs";
+
+			/**
+			 * Description: ring from oldest entry, "+ms:stage(count)"
+			 */
+			unsigned int pos = f->holdpos.load(boost::memory_order_relaxed);
+			for (unsigned int k = 0; k < FRAME_HOLD_HISTORY; k++)
+			{
+				unsigned int j = (pos + k) % FRAME_HOLD_HISTORY;
+				boost::uint64_t e = f->holdhist[j].load(boost::memory_order_relaxed);
+				const char *s = f->holdstage[j].load(boost::memory_order_relaxed);
+				if (e)
+					std::cout << " +" << (long long)((e >> 16) - since) << "ms:" << (s ? s : "unknown") << "(" << (e & 0xFFFF) << ")";
+			}
+			std::cout << std::endl;
+		}
+	}
+
+	/**
+	 * Description: an allocation of "who" waited "waited" ms, report residency at most once
+					every StallReportInterval ms
+	 */
+	void Stall(const char *who, unsigned int waited)
+	{
+		boost::uint64_t now = MetricsClock();
+		boost::uint64_t last = lastreport;
+
+		if (last && ((now - last) < StallReportInterval * 1000ULL))
+			return;
+
+		if (!lastreport.compare_exchange_strong(last, now))
+			return;
+
+		std::cout << "[warning] " << who << " allocation stalled for " << waited << "ms. err(" << busy << ")" << std::endl;
+		Residency();
+	}
+
+	/**
+	 * Description: stop handing out frames and wait at most "timeout" ms for all frames
+					returned, return true if no frame is referenced any more
+	 */
+	bool Drain(unsigned int timeout)
+	{
+		quit = true;
+
+		boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(timeout);
+
+		waiters++;
+		{
+			boost::unique_lock<boost::mutex> lock(waitmtx);
+
+			/* wake up blocked Get */
+			waitcv.notify_all();
+
+			while (busy && (boost::chrono::steady_clock::now() < deadline))
+			{
+				/* short slices, a Put racing with waiters registration does not notify */
+				waitcv.wait_for(lock, boost::chrono::milliseconds(10));
+			}
+		}
+		waiters--;
+
+		if (busy)
+		{
+			FORMAT_WARNING("frame pool drain timeout, frames still referenced", busy);
+			return false;
+		}
+
+		return true;
+	}
+
+private:
+	static const unsigned int SlotNil = 0xFFFFFFFF;	/* empty stack */
+
+	static inline boost::uint64_t FreeHead(boost::uint32_t tag, boost::uint32_t slot)
+	{
+		return ((boost::uint64_t)tag << 32) | slot;
+	}
+
+	inline void Push(unsigned int slot)
+	{
+		boost::uint64_t h = head.load(boost::memory_order_relaxed);
+		do
+		{
+			next[slot].store((boost::uint32_t)h, boost::memory_order_relaxed);
+		} while (!head.compare_exchange_weak(h, FreeHead((boost::uint32_t)(h >> 32) + 1, slot),
+			boost::memory_order_release, boost::memory_order_relaxed));
+	}
+
+	inline unsigned int Pop()
+	{
+		boost::uint64_t h = head.load(boost::memory_order_acquire);
+		while ((boost::uint32_t)h != SlotNil)
+		{
+			boost::uint32_t slot = (boost::uint32_t)h;
+			if (head.compare_exchange_weak(h, FreeHead((boost::uint32_t)(h >> 32) + 1, next[slot].load(boost::memory_order_relaxed)),
+				boost::memory_order_acquire, boost::memory_order_acquire))
+			{
+				return slot;
+			}
+		}
+
+		return SlotNil;
+	}
+
+	/**
+	 * Description: a frame returned or a Get failed. pool may be destroyed once Drain sees
+					busy 0, with a waiter busy drops under waitmtx so Drain sees it only after
+					the notify, without one nothing is touched after the decrement
+	 */
+	inline void Unbusy()
+	{
+		if (waiters > 0)
+		{
+			boost::lock_guard<boost::mutex> lock(waitmtx);
+			busy--;
+			waitcv.notify_all();
+		}
+		else
+		{
+			busy--;
+		}
 	}
 
 private:
@@ -250,12 +885,28 @@ private:
 	IFrameRestore *							pres;		/* buffer restore handle */
 
 	/**
-	* Description: raw ISmartFrame object pool
+	* Description: preallocated ISmartFrame objects and their free stack
 	*/
-	boost::recursive_mutex					mtx;		/* pool lock */
-	unsigned int							totalsize;	/* pool max size */
-	std::vector<ISmartFrame*>				freefrms;	/* unused frames */
-	std::map<ISmartFrame*, unsigned int>	busyfrms;	/* save thread tid which correspond with same decoder */
+	unsigned int							totalsize;	/* pool size */
+	SmartFrame **							frames;		/* all frames, indexed by slot */
+	boost::atomic_uint32_t *				next;		/* free stack link of each slot */
+	boost::atomic_uint64_t					head;		/* free stack head, tag << 32 | slot */
+	boost::atomic_uint32_t					busy;		/* frames handed out */
+	SmartFrameShared						shared;		/* host mirror and derivative buffers */
+
+	/**
+	* Description: slow path of exhausted Get and Drain
+	*/
+	unsigned int							waitms;		/* Get wait bound, millisecond */
+	boost::atomic_uint32_t					waiters;	/* threads blocked on waitcv */
+	boost::mutex							waitmtx;	/* lock for waitcv */
+	boost::condition_variable				waitcv;		/* frame returned notify */
+
+	/**
+	* Description: stall attribution
+	*/
+	unsigned int							stallms;	/* Get waiting longer reports residency, millisecond */
+	boost::atomic_uint64_t					lastreport;	/* last residency report, MetricsClock */
 };
 
 
@@ -269,12 +920,18 @@ public:
 		const unsigned int	time_out = 40		/* millisecond */,
 		bool				loop = false)
 
-		:fbcb(fbroutine), invoker(invk), cudactx(cuctx), sfpool(0), batchpipe(OnBatchPop, this, batch_size), decdevpool(512), looplay(loop)
+		:fbcb(fbroutine), fbdesccb(NULL), invoker(invk), cudactx(cuctx), sfpool(0), lookback(NULL), clipper(NULL), mapheld(0), outw(0), outh(0), aspect(0), maxw(0), maxh(0), surfhead(0), qwait(DecodeQueueWait), deadline(NULL), batchpipe(OnBatchPop, this, batch_size), decdevpool(512), looplay(loop), quit(false)
 	{
 		FORMAT_DEBUG(__FUNCTION__, __LINE__, "constructing FrameBatchPipe");
 		BOOST_ASSERT(fbroutine);
 
 		timeout = min(max((int)time_out, 1), 50);		/* [1,50] */
+		memset(croprect, 0, sizeof(croprect));
+
+		/**
+		 * Description: report numa topology used for reader/decoder placement
+		 */
+		ThreadPlacement::Instance().Report();
 
 		if (!cudactx)
 		{
@@ -287,12 +944,17 @@ public:
 		/**
 		 * Description: create smart frame pool
 		 */
-		sfpool = new SmartFramePool(this/* default size 1024 */);
+		sfpool = new SmartFramePool(this, 1024, 1000, cudactx);
 		if (!sfpool)
 		{
 			throw("create smart frame pool failed");
 		}
 
+		/**
+		 * Description: device buffers are held through frames, a stalled decoder reports frame residency
+		 */
+		decdevpool.OnStall(OnDeviceStall, this);
+
 		/**
 		 * Description: start up force push timer thread
 		 */
@@ -305,6 +967,21 @@ public:
 
 	~FrameBatchPipe()
 	{
+		if (!Drain(DrainTimeout))
+		{
+			/**
+			 * Description: frames still referenced by user would return to a dead pool, leak it
+			 */
+			FORMAT_WARNING("frames still referenced on destruction, frame pool leaked", sfpool->BusySize());
+			sfpool = NULL;
+		}
+
+		/**
+		 * Description: decoders of ended streams are kept for reuse, destroy them while the
+						driver is up
+		 */
+		NvCodec::DecoderCache::Instance().Shutdown();
+
 		if (deadline)
 		{
 			boost::system::error_code err;
@@ -329,10 +1006,32 @@ public:
 			delete sfpool;
 			sfpool = NULL;
 		}
+
+		if (lookback)
+		{
+			delete lookback;
+			lookback = NULL;
+		}
+
+		if (clipper)
+		{
+			delete clipper;
+			clipper = NULL;
+		}
 	}
 
 	int Startup(std::string &srcvideo)
 	{
+		if (clipper && ((tid2parser.size() + 1) * clipper->Frames() > ClipFrames()))
+		{
+			/**
+			 * Description: clip windows of all streams would exhaust the buffers decoders
+							wait on, refuse the stream
+			 */
+			FORMAT_WARNING("stream refused, clip windows exceed half of frame and device pools", tid2parser.size() + 1);
+			return -1;
+		}
+
 		// [TODO] increace pool size
 		decdevpool.dilation(4);
 
@@ -353,10 +1052,11 @@ public:
 	inline int InputFrame(NvCodec::CuFrame &frame, unsigned int tid, BaseCodec* decoder)
 	{
 		return InputFrame((unsigned char *)frame.dev_frame,
-			frame.w, frame.h, frame.dev_pitch, frame.timestamp, frame.last, tid, decoder);
+			frame.w, frame.h, frame.dev_pitch, frame.timestamp, frame.last, tid, decoder, frame.ready);
 	}
 
-	int InputFrame(unsigned char *imageGpu, unsigned int w, unsigned int h, unsigned int s, unsigned long long t, bool last, unsigned int tid, BaseCodec* decoder)
+	int InputFrame(unsigned char *imageGpu, unsigned int w, unsigned int h, unsigned int s, unsigned long long t, bool last, unsigned int tid, BaseCodec* decoder,
+		void *ready = NULL /* cudaEvent_t completing the data at "imageGpu", NULL if complete */)
 	{
 		/**
 		* Description: convert PCC_Frame to SmartFrame
@@ -381,6 +1081,7 @@ public:
 				 * Description: initialize smart frame
 				 */
 				static_cast<SmartFrame*>(frame.get())->origindata = imageGpu;
+				static_cast<SmartFrame*>(frame.get())->chroma = imageGpu + s * h;
 				static_cast<SmartFrame*>(frame.get())->frameno = fidx++;
 				static_cast<SmartFrame*>(frame.get())->tid = tid;
 				static_cast<SmartFrame*>(frame.get())->step = s;
@@ -389,6 +1090,19 @@ public:
 				static_cast<SmartFrame*>(frame.get())->decoder = decoder;
 				static_cast<SmartFrame*>(frame.get())->timestamp = t;
 				static_cast<SmartFrame*>(frame.get())->last = last;
+				static_cast<SmartFrame*>(frame.get())->ready = ready;
+				static_cast<SmartFrame*>(frame.get())->inputclock = MetricsClock();
+				frame->Hold("batch assembly");
+
+				if (lookback)
+				{
+					lookback->Retain(frame);
+				}
+
+				if (clipper)
+				{
+					clipper->Add(frame);
+				}
 
 				bpush = batchpipe.push(frame);
 			}
@@ -402,9 +1116,254 @@ public:
 		return 0;
 	}
 
+	/**
+	 * Description: graceful shutdown. stop decoding threads, flush the partial batch, wait
+					at most "timeout" ms for every frame returned and release decoders and
+					device buffers. return true if everything is released in time, otherwise
+					frames are still referenced and Drain can be called again.
+	 */
+	bool Drain(unsigned int timeout)
+	{
+		boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(timeout);
+
+		/**
+		 * Description: stop intake, decoders drop pictures instead of waiting for buffers
+		 */
+		quit = true;
+		decdevpool.Close();
+
+		bool drained = true;
+		for (std::map<boost::thread::id, boost::thread *>::iterator it = tid2parser.begin(); it != tid2parser.end();)
+		{
+			if (it->second->try_join_until(deadline))
+			{
+				delete it->second;
+				tid2parser.erase(it++);
+			}
+			else
+			{
+				drained = false;
+				it++;
+			}
+		}
+
+		if (!drained)
+		{
+			FORMAT_WARNING("decoding threads not stopped in time", tid2parser.size());
+		}
+
+		/**
+		 * Description: deliver frames waiting in the current batch
+		 */
+		batchpipe.push();
+
+		if (lookback)
+		{
+			/* retained frames would never return */
+			lookback->Clear();
+		}
+
+		if (clipper)
+		{
+			clipper->Flush();
+			clipper->Clear();
+		}
+
+		if (!sfpool->Drain(DrainLeft(deadline)))
+			return false;
+
+		/**
+		 * Description: all frames returned, decoders and buffers can go
+		 */
+		{
+			boost::lock_guard<boost::recursive_mutex> lock(mtx);
+			for (int i = 0; i < retired.size(); i++)
+				delete retired[i];
+			retired.clear();
+		}
+
+		return decdevpool.Drain(DrainLeft(deadline)) && drained;
+	}
+
+	/**
+	 * Description: zero-copy roi view of a frame, see SmartFramePool::View. views can be
+					batched like frames, the parent buffer returns to pool after its last view
+	 */
+	inline ISmartFramePtr View(ISmartFramePtr parent, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+	{
+		return ISmartFramePtr(sfpool->View(parent, x, y, w, h));
+	}
+
+	/**
+	 * Description: latency of the batch hop, wait is the time a frame spent in batch
+					assembling, service is the time spent in batch callback
+	 */
+	inline StageSnapshot Metrics()
+	{
+		return batchmetrics.Snapshot();
+	}
+
+	/**
+	 * Description: nvdec streams hand mapped decoder surfaces to frames instead of copying
+					them to the device pool, surfaces are unmapped when frames return. "held"
+					is the number of frames of a stream downstream may hold at once, decoding
+					of a stream waits while that many are out, a picture waiting too long is
+					dropped. lookback and clips retain frames beyond that and are refused with
+					it, return false if refused. call before Startup.
+	 */
+	inline bool ZeroCopy(unsigned int held)
+	{
+		if (held && (lookback || clipper))
+		{
+			FORMAT_WARNING("zero-copy refused, lookback or clips retain decoder surfaces", held);
+			return false;
+		}
+
+		mapheld = held;
+		return true;
+	}
+
+	/**
+	 * Description: pool of frame device buffers, for FrameExporter to abandon buffers still
+					read by an importer
+	 */
+	inline DevicePool * DeviceBuffers()
+	{
+		return &decdevpool;
+	}
+
+	/**
+	 * Description: frames held per stream with zero-copy, 0 if frames are pool copies
+	 */
+	inline unsigned int ZeroCopyHeld()
+	{
+		return mapheld;
+	}
+
+	/**
+	 * Description: nvdec streams are scaled by the decoder to "width" x "height" with aspect
+					"mode" (NvDecoder::AspectMode), optionally from source rectangle "crop"
+					{left, top, right, bottom}. frames and device buffers are of the output
+					size. call before Startup.
+	 */
+	inline void Output(unsigned int width, unsigned int height, int mode = NvCodec::NvDecoder::AMStretch, const int *crop = NULL)
+	{
+		outw	= width;
+		outh	= height;
+		aspect	= mode;
+
+		for (int i = 0; i < 4; i++)
+			croprect[i] = crop ? crop[i] : 0;
+	}
+
+	/**
+	 * Description: nvdec decoders are created for coded size up to "width" x "height", a
+					stream changing resolution within it reconfigures its decoder in place.
+					decoders of ended streams are reused by later ones. call before Startup.
+	 */
+	inline void DecoderMaxSize(unsigned int width, unsigned int height)
+	{
+		maxw	= width;
+		maxh	= height;
+	}
+
+	/**
+	 * Description: nvdec output surfaces beyond the frames a stream maps at once, each costs
+					one output size nv12 surface of VRAM per stream. call before Startup.
+	 */
+	inline void SurfaceHeadroom(unsigned int surfaces)
+	{
+		surfhead = surfaces;
+	}
+
+	/**
+	 * Description: nvdec streams wait at most "ms" for queue room or a surface before a
+					picture is dropped, 0 waits for queue room until frames are consumed. call
+					before Startup.
+	 */
+	inline void QueueWait(unsigned int ms)
+	{
+		qwait = ms;
+	}
+
+	/**
+	 * Description: keep the latest "depth" frames of each stream, one of every "decimation"
+					decoded frames, for temporal consumers. retained frames come out of the
+					frame pool, all streams together are bound to "budget" bytes and half of
+					the pool. call before Startup, query with Lookback(). return false if
+					zero-copy is on, retained frames would pin decoder surfaces.
+	 */
+	bool EnableLookback(unsigned int depth, unsigned int decimation = 1, unsigned long long budget = (512ULL << 20))
+	{
+		BOOST_ASSERT(!lookback);
+		if (mapheld)
+		{
+			FORMAT_WARNING("lookback refused with zero-copy decoder surfaces", mapheld);
+			return false;
+		}
+
+		lookback = new FrameLookback(depth, decimation, budget, sfpool->TotalSize() / 2);
+		return true;
+	}
+
+	/**
+	 * Description: lookback rings, see FrameLookback::Find/Range/Last. NULL if not enabled
+	 */
+	inline FrameLookback * Lookback()
+	{
+		return lookback;
+	}
+
+	/**
+	 * Description: additionally deliver [streams x "length"] clip batches to "routine", a clip
+					is taken from each stream every "stride" frames, see ClipBatcher. lagging
+					streams are waited for at most "clip_timeout" ms. each stream pins up to
+					2 x "length" frames, all streams together are bound to half of the frame
+					and device pools, Startup refuses streams beyond it. call before Startup.
+					return false if zero-copy is on, clips would pin decoder surfaces, or a
+					single stream exceeds the bound.
+	 */
+	bool EnableClips(ClipBatchRoutine routine, unsigned int length, unsigned int stride, unsigned int clip_timeout = 100)
+	{
+		BOOST_ASSERT(!clipper);
+		if (mapheld)
+		{
+			FORMAT_WARNING("clips refused with zero-copy decoder surfaces", mapheld);
+			return false;
+		}
+
+		if (length * 2 > ClipFrames())
+		{
+			FORMAT_WARNING("clips refused, clip length exceeds half of frame and device pools", length);
+			return false;
+		}
+
+		clipper = new ClipBatcher(routine, invoker, length, stride, clip_timeout);
+		return true;
+	}
+
+	/**
+	 * Description: deliver batches with a structure-of-arrays descriptor to "routine" instead
+					of the routine given on construction, NULL switches back. set before Startup.
+	 */
+	inline void DescRoutine(FrameBatchDescRoutine routine)
+	{
+		fbdesccb = routine;
+	}
+
+	/**
+	 * Description: report the oldest frames out of pool and the stage holding each, frames
+					are held by "batch callback" after delivery unless the user calls Hold
+	 */
+	inline void Residency(unsigned int top = 8)
+	{
+		sfpool->Residency(top);
+	}
+
 	inline void Return(SmartFrame *sf)
 	{
 		NvCodec::CuFrame cuf((void*)sf->NV12());
+		cuf.ready = sf->Ready();	/* copy event goes back to decoder's pool */
 		sf->decoder->PutFrame(cuf);
 	}
 
@@ -421,6 +1380,28 @@ private:
 		deadline->async_wait(boost::bind(&FrameBatchPipe::PushPipeTimer, this));
 	}
 
+	/**
+	 * Description: frames clip windows of all streams may pin, half of the smaller of frame
+					and device pools
+	 */
+	inline unsigned int ClipFrames()
+	{
+		return std::min(sfpool->TotalSize(), decdevpool.size()) / 2;
+	}
+
+	static inline unsigned int DrainLeft(const boost::chrono::steady_clock::time_point &deadline)
+	{
+		boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+		return (now < deadline) ? (unsigned int)boost::chrono::duration_cast<boost::chrono::milliseconds>(deadline - now).count() : 0;
+	}
+
+	static void OnDeviceStall(unsigned int waited, void *user)
+	{
+		FrameBatchPipe *pipe = (FrameBatchPipe*)user;
+		if (pipe->sfpool)
+			pipe->sfpool->Stall("device pool", waited);
+	}
+
 	static inline void OnBatchPop(ISmartFramePtr *p, unsigned int nlen, void *user)
 	{
 		((FrameBatchPipe*)user)->BatchPop(p, nlen);
@@ -428,10 +1409,37 @@ private:
 
 	inline void BatchPop(ISmartFramePtr *p, unsigned int nlen)
 	{
-		if (fbcb)
+		unsigned long long start = MetricsClock();
+
+		for (int i = 0; i < nlen; i++)
+		{
+			if (p[i])
+			{
+				batchmetrics.Wait(start - static_cast<SmartFrame*>(p[i].get())->inputclock);
+				p[i]->Hold("batch callback");
+			}
+		}
+
+		if (fbdesccb)
+		{
+			/**
+			 * Description: forced push may pop concurrently with a full batch, storage is per thread
+			 */
+#if (__cplusplus >= 201103L)
+			static thread_local FrameBatchStore store;
+#else
+			FrameBatchStore store;
+#endif
+			fbdesccb(p, store.Fill(p, nlen, cudactx), invoker);
+		}
+		else if (fbcb)
 		{
 			fbcb(p, nlen, invoker);
 		}
+
+		batchmetrics.Service(MetricsClock() - start);
+		batchmetrics.Frames(nlen);
+		batchmetrics.Batches();
 	}
 
 	void PushPipeTimer()
@@ -456,16 +1464,27 @@ private:
 		BaseCodec*			decoder(NULL);
 		BaseMediaSource*	media(NULL);
 
+		/**
+		* Description: pin decoding thread to the stream's node before any buffer is touched,
+		media reader created below follows the same node
+		*/
+		ThreadPlacement::Instance().Pin(PSDecoder, ThreadPlacement::Instance().NextNode());
+
 		std::string threadId = boost::lexical_cast<std::string>(boost::this_thread::get_id());
     		unsigned long tid = 0;
     		sscanf(threadId.c_str(), "%lx", &tid);
 
-		if (p.extension() == boost::filesystem::path(".h264"))
+		cudaVideoCodec codec = cudaVideoCodec_H264;
+
+		if ((p.extension() == boost::filesystem::path(".h264")) || (p.extension() == boost::filesystem::path(".h265")))
 		{
 			/**
-			* Description: raw h264 file
+			* Description: raw annex-b file
 			*/
-			decoder = new NvCodec::NvDecoder(0, 4, cudactx, &decdevpool);
+			if (p.extension() == boost::filesystem::path(".h265"))
+				codec = cudaVideoCodec_HEVC;
+
+			decoder = CreateDecoder(codec);
 			media	= new NvCodec::NvMediaSource(p.string(), decoder, looplay);
 		}
 		else if (p.extension() == boost::filesystem::path(".mbf"))
@@ -474,19 +1493,26 @@ private:
 			* Description: mbf file [TODO]
 			*/
 		}
+		else if (FFCodec::FFInit() && FFCodec::FFDemuxSource::Probe(p.string(), codec))
+		{
+			/**
+			* Description: container with a stream nvdec decodes
+			*/
+			decoder = CreateDecoder(codec);
+			media	= new FFCodec::FFDemuxSource(p.string(), decoder, looplay);
+		}
 		else
 		{
 			/**
-			* Description: unrecognized format
+			* Description: unrecognized format, cpu decoding
 			*/
-			FFCodec::FFInit();
 			decoder = new FFCodec::FFMpegCodec(&decdevpool, cudactx);
 			media	= new FFCodec::FFMediaSource(p.string(), decoder);
 		}
 
 		NvCodec::CuFrame frame;
 
-		while (!frame.last)
+		while (!frame.last && !quit)
 		{
 			if (decoder->GetFrame(frame))
 			{
@@ -501,9 +1527,37 @@ private:
 				{
 					cout << "end of decoded frame" << endl;
 				}
-				InputFrame(frame, tid, decoder);
+				if (InputFrame(frame, tid, decoder))
+				{
+					/* no smart frame, draining */
+					decoder->PutFrame(frame);
+				}
 			}
 		}
+
+		/**
+		* Description: stop reader, display callback must not wait for room any more.
+		decoder is kept until all its frames returned
+		*/
+		decoder->Strategy(BaseCodec::QSPopLatest);
+		delete media;
+
+		boost::lock_guard<boost::recursive_mutex> lock(mtx);
+		retired.push_back(decoder);
+	}
+
+	/**
+	 * Description: nvdec decoder of a stream with output options applied before any input
+	 */
+	inline NvCodec::NvDecoder * CreateDecoder(cudaVideoCodec codec)
+	{
+		NvCodec::NvDecoder *dec = new NvCodec::NvDecoder(0, 4, cudactx, &decdevpool, false, mapheld, qwait, codec);
+
+		dec->Output(outw, outh, aspect);
+		dec->Crop(croprect[0], croprect[1], croprect[2], croprect[3]);
+		dec->MaxSize(maxw, maxh);
+		dec->SurfaceHeadroom(surfhead);
+		return dec;
 	}
 
 	typedef circle_batch<ISmartFramePtr> circle_batch_pipe;
@@ -513,13 +1567,28 @@ private:
 	circle_batch_pipe					batchpipe;		/* batches of SmartFrame */
 	boost::thread *						timerthread;	/* timer thread */
 	boost::asio::deadline_timer *		deadline;		/* timer object */
-	SmartPoolInterface *				sfpool;			/* smart frame pool */
+	SmartFramePool *					sfpool;			/* smart frame pool */
+	FrameLookback *						lookback;		/* per-stream retention, NULL if disabled */
+	ClipBatcher *						clipper;		/* clip batching, NULL if disabled */
+	unsigned int						mapheld;		/* zero-copy surfaces held downstream per stream, 0 copies */
+	unsigned int						outw;			/* nvdec output width, 0 follows source */
+	unsigned int						outh;			/* nvdec output height, 0 follows source */
+	int									aspect;			/* nvdec output NvDecoder::AspectMode */
+	int									croprect[4];	/* nvdec source crop {left, top, right, bottom} */
+	unsigned int						maxw;			/* nvdec coded width bound, 0 first sequence size */
+	unsigned int						maxh;			/* nvdec coded height bound, 0 first sequence size */
+	unsigned int						surfhead;		/* nvdec output surface headroom */
+	unsigned int						qwait;			/* nvdec queue wait bound, millisecond, 0 unbounded */
 	FrameBatchRoutine					fbcb;			/* frame batch ready callback */
+	FrameBatchDescRoutine				fbdesccb;		/* frame batch with descriptor callback, replaces fbcb if set */
 	void *								invoker;		/* callback pointer */
 	void *								cudactx;		/* cuda context */
 	bool								looplay;		/* loop play */
-	boost::recursive_mutex				mtx;			/* lock for free device buffer vector */
+	boost::recursive_mutex				mtx;			/* lock for retired decoders */
+	boost::atomic_bool					quit;			/* draining flag */
+	std::vector<BaseCodec*>				retired;		/* decoders of stopped threads, waiting for frames */
 	DevicePool							decdevpool;		
+	StageMetrics						batchmetrics;	/* batch hop latency and throughput */
 	std::map<boost::thread::id, boost::thread *>	tid2parser;		/* decoding threads, tid to obj */
 
 #if (__cplusplus >= 201103L)
@@ -9,12 +9,17 @@
 #include <nvcuvid.h>
 #include <string>
 #include <list>
+#include <map>
+#include <algorithm>
 #include <chrono>
 using namespace std::chrono;
 
 #include "BaseCodec.h"
 #include "DedicatedPool.h"
 #include "NvCodecFrame.h"
+#include "PtsClock.h"
+#include "CopyStream.h"
+#include "SeqHeader.h"
 
 #ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -26,6 +31,18 @@ using namespace std::chrono;
 #define NV_FAILED	0
 #define NV_OK		1
 
+/* nvdec output surface bound */
+const unsigned int MapSurfacesMax = 64;
+
+/* decode surfaces of a parser created without the stream's dpb, largest dpb plus decoding and display delay */
+const unsigned int DecodeSurfacesMax = DpbFramesMax + 4;
+
+/* millisecond a picture waits for a handed off surface when no queue wait is set */
+const unsigned int MapWaitMs = 1000;
+
+/* idle nvdec decoders kept for reuse */
+const unsigned int IdleDecodersMax = 4;
+
 namespace NvCodec
 {
 	/**
@@ -75,13 +92,218 @@ namespace NvCodec
 		}
 	};
 
+	/**
+	 * Description: idle nvdec decoders kept after their stream ended, a later stream of the same
+					codec and surface layout fitting in the maximum size takes one and
+					reconfigures it instead of creating a decoder. decoders of one context
+					share its context lock, so a decoder can move between streams. the lock
+					lives while a decoder of its context does. Shutdown must be called while
+					the driver is up, idle decoders left on exit are abandoned.
+	 */
+	class DecoderCache
+	{
+	public:
+		static DecoderCache & Instance()
+		{
+			static DecoderCache cache;
+			return cache;
+		}
+
+		~DecoderCache()
+		{
+			/* static destruction may run after driver shutdown, nothing is destroyed here */
+		}
+
+		/**
+		 * Description: context lock shared by decoders of "ctx", NULL on failure. every lock
+						taken is given back with Release
+		 */
+		CUvideoctxlock Lock(CUcontext ctx)
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+
+			std::map<CUcontext, SharedLock>::iterator it = locks.find(ctx);
+			if (it != locks.end())
+			{
+				it->second.users++;
+				return it->second.lock;
+			}
+
+			CUvideoctxlock ctxlock = NULL;
+			int ret = 0;
+			if (ret = cuvidCtxLockCreate(&ctxlock, ctx))
+			{
+				FORMAT_FATAL("create context lock failed", ret);
+				return NULL;
+			}
+
+			SharedLock shared = { ctxlock, 1 };
+			locks[ctx] = shared;
+			return ctxlock;
+		}
+
+		/**
+		 * Description: give back the context lock of "ctx", destroyed with its last user
+		 */
+		void Release(CUcontext ctx)
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			Unuse(ctx);
+		}
+
+		/**
+		 * Description: keep idle "decoder" created with "info", the oldest idle one is destroyed
+						beyond IdleDecodersMax. idle decoders use the context lock.
+		 */
+		void Put(CUcontext ctx, CUvideodecoder decoder, const CUVIDDECODECREATEINFO &info)
+		{
+			Idle dec = { ctx, decoder, info };
+
+			boost::lock_guard<boost::mutex> lock(mtx);
+			idle.push_back(dec);
+			locks[ctx].users++;
+
+			if (idle.size() > IdleDecodersMax)
+			{
+				Evict(idle.begin());
+			}
+		}
+
+		/**
+		 * Description: smallest idle decoder of "ctx" fitting "want", its creation info in "info",
+						NULL if none
+		 */
+		CUvideodecoder Take(CUcontext ctx, const CUVIDDECODECREATEINFO &want, CUVIDDECODECREATEINFO &info)
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+
+			std::list<Idle>::iterator best = idle.end();
+			for (std::list<Idle>::iterator it = idle.begin(); it != idle.end(); it++)
+			{
+				if ((it->ctx == ctx) && Fits(want, it->info) && ((best == idle.end()) || (Samples(it->info) < Samples(best->info))))
+					best = it;
+			}
+
+			if (best == idle.end())
+				return NULL;
+
+			/* taker holds the context lock itself */
+			CUvideodecoder decoder = best->decoder;
+			info = best->info;
+			idle.erase(best);
+			Unuse(ctx);
+			return decoder;
+		}
+
+		/**
+		 * Description: destroy idle decoders, and context locks no decoder uses any more. call
+						it when decoding is done, before the driver goes down
+		 */
+		void Shutdown()
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+
+			while (idle.size())
+			{
+				Evict(idle.begin());
+			}
+		}
+
+		/**
+		 * Description: destroy "decoder" of the context locked by "ctxlock", holding the lock
+		 */
+		static int Destroy(CUvideodecoder decoder, CUvideoctxlock ctxlock)
+		{
+			cuvidCtxLock(ctxlock, 0);
+			int ret = cuvidDestroyDecoder(decoder);
+			cuvidCtxUnlock(ctxlock, 0);
+
+			return ret;
+		}
+
+		/**
+		 * Description: decoder created with "have" decodes "want" after reconfiguration
+		 */
+		static inline bool Fits(const CUVIDDECODECREATEINFO &want, const CUVIDDECODECREATEINFO &have)
+		{
+			return (want.CodecType == have.CodecType)
+				&& (want.ChromaFormat == have.ChromaFormat)
+				&& (want.bitDepthMinus8 == have.bitDepthMinus8)
+				&& (want.OutputFormat == have.OutputFormat)
+				&& (want.DeinterlaceMode == have.DeinterlaceMode)
+				&& (want.ulCreationFlags == have.ulCreationFlags)
+				&& (want.ulNumOutputSurfaces == have.ulNumOutputSurfaces)
+				&& (want.ulNumDecodeSurfaces <= have.ulNumDecodeSurfaces)
+				&& (want.ulWidth <= have.ulMaxWidth)
+				&& (want.ulHeight <= have.ulMaxHeight);
+		}
+
+	private:
+		DecoderCache() {}
+
+		/* decode surface samples, VRAM order of idle decoders */
+		static inline unsigned long long Samples(const CUVIDDECODECREATEINFO &info)
+		{
+			return (unsigned long long)info.ulMaxWidth * info.ulMaxHeight * info.ulNumDecodeSurfaces;
+		}
+
+		struct Idle
+		{
+			CUcontext				ctx;		/* context created in */
+			CUvideodecoder			decoder;	/* idle decoder */
+			CUVIDDECODECREATEINFO	info;		/* creation info */
+		};
+
+		struct SharedLock
+		{
+			CUvideoctxlock			lock;		/* context lock */
+			unsigned int			users;		/* live and idle decoders using it */
+		};
+
+		/**
+		 * Description: destroy idle decoder "it", mtx held
+		 */
+		void Evict(std::list<Idle>::iterator it)
+		{
+			int ret = 0;
+			if (ret = Destroy(it->decoder, locks[it->ctx].lock))
+			{
+				FORMAT_WARNING("destroy idle decoder failed", ret);
+			}
+
+			CUcontext ctx = it->ctx;
+			idle.erase(it);
+			Unuse(ctx);
+		}
+
+		/**
+		 * Description: one user less of context lock of "ctx", mtx held
+		 */
+		void Unuse(CUcontext ctx)
+		{
+			std::map<CUcontext, SharedLock>::iterator it = locks.find(ctx);
+			if ((it == locks.end()) || --it->second.users)
+				return;
+
+			cuvidCtxLockDestroy(it->second.lock);
+			locks.erase(it);
+		}
+
+		boost::mutex							mtx;	/* lock for idle and locks */
+		std::list<Idle>							idle;	/* idle decoders, oldest first */
+		std::map<CUcontext, SharedLock>			locks;	/* context lock of each context */
+	};
+
 	class NvDecoder : public BaseCodec
 	{
 	public:
 		/**
 		* Description: 
 		*/
-		NvDecoder(unsigned int devidx = 0, unsigned int queuelen = 8, void *cudactx = NULL, DevicePool* devpool = NULL, bool map2host = false)
+		NvDecoder(unsigned int devidx = 0, unsigned int queuelen = 8, void *cudactx = NULL, DevicePool* devpool = NULL, bool map2host = false,
+			unsigned int mapped_surfaces = 0 /* zero-copy hand-off of mapped surfaces if > 0, frames held downstream at most */,
+			unsigned int queue_wait = 0 /* millisecond, QSWait drops a picture waiting longer for queue room, 0 waits on */,
+			cudaVideoCodec codec = cudaVideoCodec_H264 /* parser codec, probed from container for non raw input */)
 			: cuCtx((CUcontext)cudactx)
 			, cuCtxLock(NULL)
 			, cuParser(NULL)
@@ -95,7 +317,23 @@ namespace NvCodec
 			, bLocalPool((devpool == NULL) ? true : false)
 			, devicepool(devpool)
 			, framepool((queuelen<<2))
+			, mapheld(mapped_surfaces)
+			, qwaitms(queue_wait)
+			, blockedus(0)
+			, qdropped(0)
+			, ptsin(false)
+			, codectype(codec)
+			, parsersurf(DecodeSurfacesMax)
+			, outw(0)
+			, outh(0)
+			, aspect(AMStretch)
+			, maxw(0)
+			, maxh(0)
+			, surfhead(0)
+			, vrambytes(0)
 		{
+			memset(&croprect, 0, sizeof(croprect));
+			memset(&createinfo, 0, sizeof(createinfo));
 			int ret = Init();
 			if (ret) throw ret;
 		}
@@ -131,22 +369,37 @@ namespace NvCodec
 				}
 			}
 
-			if (!cuCtxLock && (ret = cuvidCtxLockCreate(&cuCtxLock, cuCtx)))
+			if (!cuCtxLock && !(cuCtxLock = DecoderCache::Instance().Lock(cuCtx)))
 			{
-				FORMAT_FATAL("create context lock failed", ret);
 				ctxcreatelock.unlock();
-				return ret;
+				return -1;
 			}
 			ctxcreatelock.unlock();
 
 			/**
-			* Description: create video parser
-			*/
+			 * Description: frame copies are ordered on the decoder's own stream
+			 */
+			cuvidCtxLock(cuCtxLock, 0);
+			copystream.Create();
+			cuvidCtxUnlock(cuCtxLock, 0);
+
+			/* video parser is created with the first input, sized from its sequence header */
+			return ret;
+		}
+
+		/**
+		* Description: create video parser cycling through "surfaces" decode surfaces. parsers
+		honouring the sequence callback return switch to the stream's count, older ones keep it
+		*/
+		int CreateParser(unsigned int surfaces)
+		{
+			int ret = 0;
+
 			CUVIDPARSERPARAMS videoParserParameters = {};
-			/* my sample only support h264 stream */
-			videoParserParameters.CodecType = cudaVideoCodec_H264;
+			/* stream codec */
+			videoParserParameters.CodecType = codectype;
 			/* stream cached length */
-			videoParserParameters.ulMaxNumDecodeSurfaces = (qlen << 1);
+			videoParserParameters.ulMaxNumDecodeSurfaces = parsersurf = surfaces;
 			/* delay for 1 */
 			videoParserParameters.ulMaxDisplayDelay = 1;
 			/* user data */
@@ -172,18 +425,33 @@ namespace NvCodec
 		{
 			int ret = 0;
 
+			/**
+			 * Description: copied surfaces are unmapped once their copies complete
+			 */
+			Settle(true);
+
+			/**
+			 * Description: queued frames are pool copies or mapped surfaces
+			 */
 			boost::lock_guard<boost::recursive_mutex> lock(qmtx);
 			for (std::list<CuFrame>::iterator it = qpic.begin(); it != qpic.end(); it++)
 			{
-#ifdef WIN32
-				if (ret = cuvidUnmapVideoFrame(cuDecoder, (unsigned int)it->dev_frame))
-#else
-				if (ret = cuvidUnmapVideoFrame(cuDecoder, (unsigned long long)it->dev_frame))
-#endif
-				{
-					FORMAT_WARNING("unmap video frame failed", ret);
-				}
+				PutFrame(*it);
 			}
+			qpic.clear();
+
+			/**
+			 * Description: decoders replaced on sequence change, surfaces still out are abandoned.
+							current decoder with no surface out is kept for a later stream
+			 */
+			for (std::list<CUvideodecoder>::iterator it = stale.begin(); it != stale.end(); it++)
+			{
+				DecoderCache::Destroy(*it, cuCtxLock);
+			}
+			stale.clear();
+
+			bool idle = cuDecoder && !Mapped(cuDecoder);
+			mapped.clear();
 
 			if (cuParser && (ret = cuvidDestroyVideoParser(cuParser)))
 			{
@@ -191,16 +459,27 @@ namespace NvCodec
 				throw ret;
 			}
 
-			if (cuDecoder && (ret = cuvidDestroyDecoder(cuDecoder)))
+			if (idle)
+			{
+				DecoderCache::Instance().Put(cuCtx, cuDecoder, createinfo);
+				cuDecoder = NULL;
+			}
+
+			if (cuDecoder && (ret = DecoderCache::Destroy(cuDecoder, cuCtxLock)))
 			{
 				FORMAT_FATAL("destroy video decoder failed", ret);
 				throw ret;
 			}
 
-			if (cuCtxLock && (ret = cuvidCtxLockDestroy(cuCtxLock)))
+			cuvidCtxLock(cuCtxLock, 0);
+			copystream.Destroy();
+			cuvidCtxUnlock(cuCtxLock, 0);
+
+			/* context lock is shared by decoders of the context */
+			if (cuCtxLock)
 			{
-				FORMAT_FATAL("destroy context lock failed", ret);
-				throw ret;
+				DecoderCache::Instance().Release(cuCtx);
+				cuCtxLock = NULL;
 			}
 
 			if (bLocalPool)
@@ -212,6 +491,25 @@ namespace NvCodec
 
 		inline bool InputStream(unsigned char* pStream, unsigned int nSize)
 		{
+			return Parse(pStream, nSize, 0, false);
+		}
+
+		/**
+		 * Description: input with presentation timestamp "pts" in 10MHz units, frames are
+						stamped from it instead of the synthetic clock
+		 */
+		inline bool InputStream(unsigned char* pStream, unsigned int nSize, long long pts)
+		{
+			return Parse(pStream, nSize, pts, true);
+		}
+
+		inline bool Parse(unsigned char* pStream, unsigned int nSize, long long pts, bool haspts)
+		{
+			if (!cuParser)
+			{
+				CreateParser(ParserSurfaces(pStream, nSize));
+			}
+
 			if (cuParser)
 			{
 				int ret = 0;
@@ -219,9 +517,16 @@ namespace NvCodec
 				CUVIDSOURCEDATAPACKET packet = { 0 };
 				packet.payload = pStream;
 				packet.payload_size = nSize;
+				if (haspts && pStream && nSize)
+				{
+					packet.flags		|= CUVID_PKT_TIMESTAMP;
+					packet.timestamp	= pts;
+					ptsin				= true;
+				}
+
 				if (!pStream || (nSize == 0))
 				{
-					packet.flags	= CUVID_PKT_ENDOFSTREAM;
+					packet.flags	|= CUVID_PKT_ENDOFSTREAM;
 					beof			= true;
 				}
 
@@ -268,6 +573,9 @@ namespace NvCodec
 				}
 			}
 
+			/* room for display callback */
+			qcv.notify_all();
+
 			if (bMap2Host)
 			{
 				/**
@@ -278,7 +586,13 @@ namespace NvCodec
 
 				BOOST_ASSERT(pic.host_frame);
 
-				int ret = cudaMemcpy(pic.host_frame, pic.dev_frame, pic.dev_pitch * pic.h + ((pic.dev_pitch * pic.h) >> 1), cudaMemcpyDeviceToHost);
+				/* ordered after the copy into dev_frame on the same stream */
+				cuvidCtxLock(cuCtxLock, 0);
+				int ret = cudaMemcpyAsync(pic.host_frame, pic.dev_frame, pic.dev_pitch * pic.h + ((pic.dev_pitch * pic.h) >> 1), cudaMemcpyDeviceToHost, copystream.Stream());
+				if (!ret)
+					ret = cudaStreamSynchronize(copystream.Stream());
+				cuvidCtxUnlock(cuCtxLock, 0);
+
 				if (ret)
 				{
 					FORMAT_FATAL("copy frame from device to host failed", ret);
@@ -295,12 +609,16 @@ namespace NvCodec
 
 			// boost::lock_guard<boost::recursive_mutex> lk(qmtx);
 
-			if (pic.dev_frame)
+			if (pic.dev_frame && Unmap((CUdeviceptr)pic.dev_frame))
+				qcv.notify_all();	/* surface for display callback */
+			else if (pic.dev_frame)
 				devicepool->Free((unsigned char *)pic.dev_frame);
 
 			if (pic.host_frame)
 				framepool.Free(pic.host_frame);
 
+			copystream.Release(pic.ready);
+
 			memset(&pic, 0, sizeof(pic));
 
 			return true;
@@ -311,8 +629,88 @@ namespace NvCodec
 			/* get */
 			if (s == -1) return qstrategy;
 			BOOST_ASSERT((s >= QSWait) && (s < QSMax));
-			/* set */
-			return (qstrategy = s);
+			/* set, a waiting display callback applies it */
+			qstrategy = s;
+			qcv.notify_all();
+			return s;
+		}
+
+		/**
+		 * Description: microseconds display callback spent blocked on queue room or surfaces
+		 */
+		inline unsigned long long BlockedTime()
+		{
+			return blockedus;
+		}
+
+		/**
+		 * Description: pictures dropped by a bounded QSWait or by the bounded wait for a
+						handed off surface
+		 */
+		inline unsigned long long WaitDropped()
+		{
+			return qdropped;
+		}
+
+		enum AspectMode
+		{
+			AMStretch = 0,	/* scale to exactly width x height */
+			AMFit = 1,		/* keep aspect, scale to fit within width x height */
+			AMFill = 2,		/* keep aspect, crop source center to fill width x height */
+			AMMax
+		};
+
+		/**
+		 * Description: decoder scaler output of "width" x "height" with "mode", 0 of one side
+						follows source aspect, 0 of both keeps source size. applied on the next
+						sequence, call before input.
+		 */
+		inline void Output(unsigned int width, unsigned int height, int mode = AMStretch)
+		{
+			BOOST_ASSERT((mode >= AMStretch) && (mode < AMMax));
+			outw	= width;
+			outh	= height;
+			aspect	= mode;
+		}
+
+		/**
+		 * Description: decode only source rectangle [left, right) x [top, bottom) in coded pixels,
+						clipped to display area. empty rectangle decodes display area. applied
+						on the next sequence, call before input.
+		 */
+		inline void Crop(int left, int top, int right, int bottom)
+		{
+			croprect.left	= left;
+			croprect.top	= top;
+			croprect.right	= right;
+			croprect.bottom	= bottom;
+		}
+
+		/**
+		 * Description: coded size decoders are created for, a later sequence up to it reconfigures
+						the decoder in place instead of recreating. call before input.
+		 */
+		inline void MaxSize(unsigned int width, unsigned int height)
+		{
+			maxw	= width;
+			maxh	= height;
+		}
+
+		/**
+		 * Description: output surfaces beyond the frames mapped at once, lets decoding run ahead
+						of the display callback. applied on the next sequence, call before input.
+		 */
+		inline void SurfaceHeadroom(unsigned int surfaces)
+		{
+			surfhead = surfaces;
+		}
+
+		/**
+		 * Description: VRAM estimate of the current decoder surfaces and queued frame copies
+		 */
+		inline unsigned long long VramBytes()
+		{
+			return vrambytes;
 		}
 		
 		/**
@@ -351,16 +749,6 @@ namespace NvCodec
 				}
 			}
 
-			/**
-			 * Description: video sequence change
-			 */
-			if (cuDecoder && (ret = cuvidDestroyDecoder(cuDecoder)))
-			{
-				FORMAT_WARNING("destroy decoder failed", ret);
-			}
-
-			cuDecoder = NULL;
-
 			CUVIDDECODECREATEINFO videoDecodeCreateInfo = { 0 };
 			memset(&videoDecodeCreateInfo, 0, sizeof(CUVIDDECODECREATEINFO));
 			/* codec type */
@@ -377,37 +765,103 @@ namespace NvCodec
 			/* adapte with interlacing */
 			videoDecodeCreateInfo.DeinterlaceMode		= cudaVideoDeinterlaceMode_Adaptive;
 
-			/* decoded video resolution */
+			/* decoded video resolution, scaled and cropped by decoder if asked */
 			videoDecodeCreateInfo.ulTargetWidth			= cWidth	= pVideoFormat->coded_width;
 			videoDecodeCreateInfo.ulTargetHeight		= cHeight	= pVideoFormat->coded_height;
+			Geometry(pVideoFormat, videoDecodeCreateInfo);
 
-			/* inner decoded picture cache buffer */
-			videoDecodeCreateInfo.ulNumOutputSurfaces	= (1);
+			/* inner decoded picture cache buffer, zero-copy keeps queued and downstream frames mapped */
+			videoDecodeCreateInfo.ulNumOutputSurfaces	= std::min((mapheld ? (qlen + mapheld) : 1) + surfhead, MapSurfacesMax);
 
 			/* using dedicated video engines */
 			videoDecodeCreateInfo.ulCreationFlags		= cudaVideoCreate_PreferCUVID;
 
-			/* inner decoding cache buffer */
-			videoDecodeCreateInfo.ulNumDecodeSurfaces	= (12);
+			/* inner decoding cache buffer, reference frames of the stream plus the one decoding */
+			videoDecodeCreateInfo.ulNumDecodeSurfaces	= DecodeSurfaces(pVideoFormat);
 
 			/* context lock */
 			videoDecodeCreateInfo.vidLock				= cuCtxLock;
 
+			/* resolution bound of in place reconfiguration */
+			videoDecodeCreateInfo.ulMaxWidth			= std::max((unsigned long)maxw, videoDecodeCreateInfo.ulWidth);
+			videoDecodeCreateInfo.ulMaxHeight			= std::max((unsigned long)maxh, videoDecodeCreateInfo.ulHeight);
+
 			/* ulNumOutputSurfaces and ulNumDecodeSurfaces is the major param which will affect
 			VRAM usage, ulNumOutputSurfaces gives the number of frames can map concurrently in 
 			display	callback, ulNumDecodeSurfaces represent nvidia decoder inner buffer upper 
 			bound. if decoder is used in a VRAM limited condition, try to adjust the param above */
 
+			/**
+			 * Description: repeated sequence header of an unchanged format, e.g. loop play,
+							keeps the decoder
+			 */
+			if (cuDecoder && Unchanged(videoDecodeCreateInfo))
+			{
+				return videoDecodeCreateInfo.ulNumDecodeSurfaces;
+			}
+
+			/* surfaces still being copied out */
+			Settle(true);
+
+			/**
+			 * Description: format change within the decoder bound reconfigures it in place, no
+							surface may be mapped meanwhile
+			 */
+			if (cuDecoder && DecoderCache::Fits(videoDecodeCreateInfo, createinfo) && !Handed(cuDecoder)
+				&& !Reconfigure(cuDecoder, videoDecodeCreateInfo, createinfo))
+			{
+				Report(videoDecodeCreateInfo, "reconfigured");
+				epoch = system_clock::now();
+				return videoDecodeCreateInfo.ulNumDecodeSurfaces;
+			}
+
+			/**
+			 * Description: video sequence change
+			 */
+			if (cuDecoder)
+			{
+				Retire(cuDecoder);
+			}
+
+			cuDecoder = NULL;
+
+			/**
+			 * Description: idle decoder left by an ended stream
+			 */
+			CUVIDDECODECREATEINFO idleinfo;
+			if (cuDecoder = DecoderCache::Instance().Take(cuCtx, videoDecodeCreateInfo, idleinfo))
+			{
+				if (ret = Reconfigure(cuDecoder, videoDecodeCreateInfo, idleinfo))
+				{
+					FORMAT_WARNING("reconfigure idle decoder failed", ret);
+					DecoderCache::Destroy(cuDecoder, cuCtxLock);
+					cuDecoder = NULL;
+				}
+			}
+
 			/**
 			 * Description: creating decoder
 			 */
-			if (ret = cuvidCreateDecoder(&cuDecoder, &videoDecodeCreateInfo))
+			if (!cuDecoder)
 			{
-				/**
-				 * Description: create decoder failed
-				 */
-				FORMAT_FATAL("create video decoder failed", ret);
-				cuDecoder = NULL;
+				if (ret = cuvidCreateDecoder(&cuDecoder, &videoDecodeCreateInfo))
+				{
+					/**
+					 * Description: create decoder failed
+					 */
+					FORMAT_FATAL("create video decoder failed", ret);
+					cuDecoder = NULL;
+				}
+				else
+				{
+					createinfo = videoDecodeCreateInfo;
+					Report(videoDecodeCreateInfo, "created");
+				}
+			}
+			else
+			{
+				createinfo = idleinfo;
+				Report(videoDecodeCreateInfo, "reused");
 			}
 
 			/**
@@ -415,7 +869,8 @@ namespace NvCodec
 			 */
 			epoch = system_clock::now();
 
-			return ret ? NV_FAILED : NV_OK;
+			/* parser decode surfaces follow the decoder */
+			return ret ? NV_FAILED : videoDecodeCreateInfo.ulNumDecodeSurfaces;
 		}
 
 		/**
@@ -451,86 +906,539 @@ namespace NvCodec
 			videoProcessingParameters.second_field		= 0;
 			videoProcessingParameters.top_field_first	= pDispInfo->top_field_first;
 			videoProcessingParameters.unpaired_field	= (pDispInfo->progressive_frame == 1);
+			videoProcessingParameters.output_stream		= (CUstream)copystream.Stream();	/* post processing orders before copies */
 
 			CUdeviceptr		pSrc	= 0;
 			unsigned int	nPitch	= 0;
+			void *			ready	= NULL;
+
+			Settle(false);
 
 			/**
-			* Description: get decoded frame from inner queue
+			* Description: get decoded frame from inner queue, when every output surface is
+			handed off wait for one unmapped, or for the oldest copy out of a surface. holders
+			downstream may pin every handed off surface, so the wait is bounded and the picture
+			is dropped when it expires or the stream is stopping
 			*/
+			boost::chrono::steady_clock::time_point mapdeadline = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(qwaitms ? qwaitms : MapWaitMs);
 			int ret = 0;
 			while (ret = cuvidMapVideoFrame(cuDecoder, pDispInfo->picture_index, &pSrc,
 				&nPitch, &videoProcessingParameters))
 			{
-				boost::this_thread::sleep(boost::posix_time::microseconds(100));
+				if (unmapq.size())
+				{
+					if (unmapq.front().ev)
+						cudaEventSynchronize(unmapq.front().ev);
+					Settle(false);
+					continue;
+				}
+
+				if (!Handed(cuDecoder))
+				{
+					/* no surface out to wait for */
+					FORMAT_WARNING("map video frame failed", ret);
+					return 0;
+				}
+
+				if ((QSPopLatest == qstrategy) || (boost::chrono::steady_clock::now() >= mapdeadline))
+				{
+					qdropped++;
+					return 0;
+				}
+
+				boost::unique_lock<boost::recursive_mutex> lock(qmtx);
+				Block(lock, boost::chrono::steady_clock::now() + boost::chrono::milliseconds(1));
 			}
 
 			// return cuvidUnmapVideoFrame(cuDecoder, pSrc);
 
+			boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(qwaitms);
+			unsigned long long timestamp = Timestamp(pDispInfo->timestamp);
+
+			boost::unique_lock<boost::recursive_mutex> lock(qmtx);
 			do
 			{
 				/**
 				 * Description: ensure there's room for new picture
 				 */
+				if (beof) qlen++;
+				if (qpic.size() < (qlen))
 				{
-					if (qmtx.try_lock())
+					/* have free space */
+					void* devbuf = NULL;
+					if (mapheld)
 					{
-						static const system_clock::duration dn(1000 * 40);
-						int fluc = rand() % 200;
-						system_clock::duration dran(((fluc & 0x00000001) ? fluc : -fluc));
+						/* mapped surface is the frame, unmapped in PutFrame */
+						devbuf = HandOff(pSrc);
+						pSrc = 0;
 
-						if (beof) qlen++;
-						if (qpic.size() < (qlen))
+						if (ret = Fence(ready))
+						{
+							FORMAT_FATAL("post process decoded frame failed", ret);
+						}
+					}
+					else
+					{
+						devbuf = devicepool->Alloc((nPitch * cHeight * 3) >> 1);
+						if (!devbuf)
 						{
-							/* have free space */
-							void* devbuf = devicepool->Alloc((nPitch * cHeight * 3) >> 1);
-							BOOST_ASSERT(devbuf);
+							/* pool closed, drop picture */
+							break;
+						}
 
-							cuvidCtxLock(cuCtxLock, 0);
-							ret = cudaMemcpy((void*)devbuf, (void*)pSrc, (nPitch * cHeight * 3) >> 1, cudaMemcpyDeviceToDevice);
-							cuvidCtxUnlock(cuCtxLock, 0);
+						if (ret = Copy(devbuf, pSrc, (nPitch * cHeight * 3) >> 1, ready))
+						{
+							FORMAT_FATAL("copy decoded frame failed", ret);
+						}
+					}
+
+					qpic.push_back(CuFrame(cWidth, cHeight, nPitch, devbuf, timestamp));
+					qpic.back().ready = ready;
+					break;
+				}
+
+				/* queue full */
+				if (QSPopEarliest == qstrategy)
+				{
+					void* devbuf = NULL;
+					if (mapheld)
+					{
+						devbuf = HandOff(pSrc);
+						pSrc = 0;
 
-							qpic.push_back(CuFrame(cWidth, cHeight, nPitch, devbuf, (epoch + dn + dran).time_since_epoch().count()));
-							epoch += (dn + dran);
-							qmtx.unlock();
+						if (ret = Fence(ready))
+						{
+							FORMAT_FATAL("post process decoded frame failed", ret);
+						}
+					}
+					else
+					{
+						devbuf = devicepool->Alloc((nPitch*cHeight * 3) >> 1);
+						if (!devbuf)
+						{
+							/* pool closed, drop picture */
 							break;
 						}
-						else if (qpic.size() == qlen)
+
+						if (ret = Copy(devbuf, pSrc, (nPitch * cHeight * 3) >> 1, ready))
 						{
-							/* queue full */
-							if (QSPopEarliest == qstrategy)
-							{
-								void* devbuf = devicepool->Alloc((nPitch*cHeight * 3) >> 1);
-								BOOST_ASSERT(devbuf);
-
-								ret = cudaMemcpy((void*)devbuf, (void*)pSrc, (nPitch * cHeight * 3) >> 1, cudaMemcpyDeviceToDevice);
-								if (ret)
-								{
-									FORMAT_FATAL("copy decoded frame failed", ret);
-								}
-
-								qpic.pop_front();
-								qpic.push_back(CuFrame(cWidth, cHeight, nPitch, devbuf, pDispInfo->timestamp));
-								qmtx.unlock();
-								break;
-							}
-							else if (QSPopLatest == qstrategy)
-							{
-								/* unmap current frame without queueing */
-								qmtx.unlock();
-								break;
-							}
-							qmtx.unlock();
+							FORMAT_FATAL("copy decoded frame failed", ret);
 						}
 					}
+
+					/* earliest frame is dropped, its buffer or surface goes back */
+					PutFrame(qpic.front());
+					qpic.pop_front();
+					qpic.push_back(CuFrame(cWidth, cHeight, nPitch, devbuf, timestamp));
+					qpic.back().ready = ready;
+					break;
+				}
+				else if (QSPopLatest == qstrategy)
+				{
+					/* unmap current frame without queueing */
+					break;
+				}
+
+				/**
+				 * Description: wait for GetFrame to make room, or strategy changed. a bounded
+								wait drops the picture when it expires
+				 */
+				if (qwaitms && (boost::chrono::steady_clock::now() >= deadline))
+				{
+					qdropped++;
+					break;
 				}
 
-				boost::this_thread::sleep(boost::posix_time::microseconds(1500));
+				Block(lock, qwaitms ? deadline : (boost::chrono::steady_clock::now() + boost::chrono::milliseconds(100)));
 
 			} while (1);
+			lock.unlock();
+
+			/* handed off surface stays mapped, a copied one until its copy completes */
+			if (pSrc && ready)
+			{
+				PendingUnmap p = { cuDecoder, pSrc, (cudaEvent_t)ready };
+				unmapq.push_back(p);
+				return 0;
+			}
+
+			return pSrc ? cuvidUnmapVideoFrame(cuDecoder, pSrc) : 0;
+		}
+
+		/**
+		 * Description: stream ordered copy of "len" bytes of mapped surface "src" to "dst", "ready"
+						gets the event completing it, NULL if the copy is already complete
+		 */
+		inline int Copy(void *dst, CUdeviceptr src, unsigned int len, void *&ready)
+		{
+			cuvidCtxLock(cuCtxLock, 0);
+			int ret = cudaMemcpyAsync(dst, (void*)src, len, cudaMemcpyDeviceToDevice, copystream.Stream());
+			cuvidCtxUnlock(cuCtxLock, 0);
+
+			ready = NULL;
+			return ret ? ret : Fence(ready);
+		}
+
+		/**
+		 * Description: "ready" gets the event completing work issued on the copy stream so far,
+						the stream is synchronized and "ready" is NULL if recording fails
+		 */
+		inline int Fence(void *&ready)
+		{
+			int ret = 0;
+
+			cuvidCtxLock(cuCtxLock, 0);
+			if (!(ready = copystream.Record()))
+				ret = cudaStreamSynchronize(copystream.Stream());
+			cuvidCtxUnlock(cuCtxLock, 0);
+
+			return ret;
+		}
+
+		/**
+		 * Description: unmap surfaces whose copies completed, oldest first, "all" waits for every
+						pending copy
+		 */
+		void Settle(bool all)
+		{
+			while (unmapq.size())
+			{
+				PendingUnmap &p = unmapq.front();
+				if (p.ev)
+				{
+					if (all)
+						cudaEventSynchronize(p.ev);
+					else if (cudaEventQuery(p.ev) == cudaErrorNotReady)
+						break;
+				}
 
+				int ret = 0;
+				cuvidCtxLock(cuCtxLock, 0);
+				if (ret = cuvidUnmapVideoFrame(p.decoder, p.surf))
+				{
+					FORMAT_WARNING("unmap video frame failed", ret);
+				}
+				cuvidCtxUnlock(cuCtxLock, 0);
 
-			return cuvidUnmapVideoFrame(cuDecoder, pSrc);
+				unmapq.pop_front();
+			}
+		}
+
+		/**
+		 * Description: source display area and target size of decoder from output options,
+						coded size is kept when none is set. sides are even for nv12.
+		 */
+		void Geometry(const CUVIDEOFORMAT *fmt, CUVIDDECODECREATEINFO &info)
+		{
+			bool cropped = (croprect.right > croprect.left) && (croprect.bottom > croprect.top);
+			if (!outw && !outh && !cropped)
+				return;
+
+			int l = fmt->display_area.left, t = fmt->display_area.top, r = fmt->display_area.right, b = fmt->display_area.bottom;
+			if ((r <= l) || (b <= t))
+			{
+				l = t = 0;
+				r = fmt->coded_width;
+				b = fmt->coded_height;
+			}
+
+			if (cropped)
+			{
+				int cl = std::max(l, croprect.left), ct = std::max(t, croprect.top);
+				int cr = std::min(r, croprect.right), cb = std::min(b, croprect.bottom);
+				if ((cr - cl >= 2) && (cb - ct >= 2))
+				{
+					l = cl;	t = ct;	r = cr;	b = cb;
+				}
+				else
+				{
+					FORMAT_WARNING("crop rectangle outside display area, ignored", -1);
+				}
+			}
+
+			long long sw = r - l, sh = b - t;
+			long long tw = outw, th = outh;
+
+			if (!tw && !th)
+			{
+				tw = sw;
+				th = sh;
+			}
+			else if (!tw)
+			{
+				tw = sw * th / sh;
+			}
+			else if (!th)
+			{
+				th = sh * tw / sw;
+			}
+			else if (AMFit == aspect)
+			{
+				/* shrink the side exceeding source aspect */
+				if (sw * th > tw * sh)
+					th = sh * tw / sw;
+				else
+					tw = sw * th / sh;
+			}
+			else if (AMFill == aspect)
+			{
+				/* narrow the source side exceeding target aspect, around its center */
+				if (sw * th > tw * sh)
+				{
+					long long nw = (tw * sh / th) & ~1LL;
+					l += (int)(((sw - nw) >> 1) & ~1LL);
+					r = l + (int)nw;
+				}
+				else
+				{
+					long long nh = (th * sw / tw) & ~1LL;
+					t += (int)(((sh - nh) >> 1) & ~1LL);
+					b = t + (int)nh;
+				}
+			}
+
+			info.display_area.left		= (short)l;
+			info.display_area.top		= (short)t;
+			info.display_area.right		= (short)r;
+			info.display_area.bottom	= (short)b;
+			info.ulTargetWidth			= cWidth	= std::max((unsigned int)tw & ~1u, 2u);
+			info.ulTargetHeight			= cHeight	= std::max((unsigned int)th & ~1u, 2u);
+		}
+
+		/**
+		 * Description: system_clock ticks of a displayed picture, mapped from its packet
+						timestamp "pts", or synthetic 25fps with jitter for raw input
+		 */
+		inline unsigned long long Timestamp(CUvideotimestamp pts)
+		{
+			if (ptsin)
+				return ptsclock.Map(pts);
+
+			static const system_clock::duration dn(1000 * 40);
+			int fluc = rand() % 200;
+			system_clock::duration dran(((fluc & 0x00000001) ? fluc : -fluc));
+
+			epoch += (dn + dran);
+			return epoch.time_since_epoch().count();
+		}
+
+		/**
+		 * Description: wait on qcv until "until", time spent is counted as blocked
+		 */
+		inline void Block(boost::unique_lock<boost::recursive_mutex> &lock, const boost::chrono::steady_clock::time_point &until)
+		{
+			boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+			qcv.wait_until(lock, until);
+			blockedus += boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - start).count();
+		}
+
+		/**
+		 * Description: hand mapped surface "surf" to a frame
+		 */
+		inline void * HandOff(CUdeviceptr surf)
+		{
+			boost::lock_guard<boost::mutex> lock(mapmtx);
+			mapped[surf] = cuDecoder;
+			return (void*)surf;
+		}
+
+		/**
+		 * Description: unmap "surf" if it is a handed off surface, a stale decoder is destroyed
+						with its last surface. return false if "surf" is not mapped.
+		 */
+		bool Unmap(CUdeviceptr surf)
+		{
+			CUvideodecoder owner = NULL;
+			{
+				boost::lock_guard<boost::mutex> lock(mapmtx);
+				std::map<CUdeviceptr, CUvideodecoder>::iterator it = mapped.find(surf);
+				if (it == mapped.end())
+					return false;
+
+				owner = it->second;
+				mapped.erase(it);
+			}
+
+			cuvidCtxLock(cuCtxLock, 0);
+			int ret = cuvidUnmapVideoFrame(owner, surf);
+			cuvidCtxUnlock(cuCtxLock, 0);
+
+			if (ret)
+			{
+				FORMAT_WARNING("unmap video frame failed", ret);
+			}
+
+			boost::lock_guard<boost::mutex> lock(mapmtx);
+			std::list<CUvideodecoder>::iterator it = std::find(stale.begin(), stale.end(), owner);
+			if ((it != stale.end()) && !Mapped(owner))
+			{
+				if (ret = DecoderCache::Destroy(owner, cuCtxLock))
+				{
+					FORMAT_WARNING("destroy decoder failed", ret);
+				}
+				stale.erase(it);
+			}
+
+			return true;
+		}
+
+		/**
+		 * Description: destroy "decoder" replaced by a new sequence, or keep it until its
+						surfaces still held by frames are unmapped
+		 */
+		void Retire(CUvideodecoder decoder)
+		{
+			boost::lock_guard<boost::mutex> lock(mapmtx);
+			if (Mapped(decoder))
+			{
+				stale.push_back(decoder);
+				return;
+			}
+
+			int ret = 0;
+			if (ret = DecoderCache::Destroy(decoder, cuCtxLock))
+			{
+				FORMAT_WARNING("destroy decoder failed", ret);
+			}
+		}
+
+		/**
+		 * Description: decode surfaces of a stream, the minimum reported by parser, or for parsers
+						not reporting it the surfaces the parser cycles through
+		 */
+		inline unsigned int DecodeSurfaces(const CUVIDEOFORMAT *fmt)
+		{
+			return fmt->min_num_decode_surfaces ? fmt->min_num_decode_surfaces : parsersurf;
+		}
+
+		/**
+		 * Description: decode surfaces of a parser fed "pStream" first, the dpb of its h264/hevc
+						sequence header, otherwise the largest dpb of the codec, plus surfaces for
+						decoding and display delay. a stream expected to change resolution, see
+						MaxSize, may need a larger dpb later and gets the largest.
+		 */
+		unsigned int ParserSurfaces(const unsigned char *pStream, unsigned int nSize)
+		{
+			SeqHeader seq;
+			if (pStream && !maxw && !maxh && seq.Parse(codectype, pStream, nSize))
+				return seq.Dpb() + 4;
+
+			switch (codectype)
+			{
+			case cudaVideoCodec_JPEG:
+				return 1;
+			case cudaVideoCodec_VP8:
+				return 3 + 2;
+			case cudaVideoCodec_VP9:
+				return 8 + 4;
+			case cudaVideoCodec_H264:
+			case cudaVideoCodec_H264_SVC:
+			case cudaVideoCodec_H264_MVC:
+			case cudaVideoCodec_HEVC:
+				return DecodeSurfacesMax;
+			default:
+				return 8;
+			}
+		}
+
+		/**
+		 * Description: VRAM estimate of a decoder, nv12 surfaces with 64 byte pitch and 16 row
+						alignment. decode surfaces are of the maximum size, output surfaces and
+						copied frames of the target size.
+		 */
+		inline unsigned long long SurfaceBytes(const CUVIDDECODECREATEINFO &info)
+		{
+			unsigned long long dec = ((info.ulMaxWidth + 63) & ~63ULL) * ((info.ulMaxHeight + 15) & ~15ULL) * 3 / 2;
+			unsigned long long out = ((info.ulTargetWidth + 63) & ~63ULL) * ((info.ulTargetHeight + 15) & ~15ULL) * 3 / 2;
+
+			return dec * info.ulNumDecodeSurfaces + out * (info.ulNumOutputSurfaces + (mapheld ? 0 : qlen));
+		}
+
+		/**
+		 * Description: report surface counts and VRAM of the decoder, "want" is the stream's need
+		 */
+		inline void Report(const CUVIDDECODECREATEINFO &want, const char *how)
+		{
+			vrambytes = SurfaceBytes(createinfo);
+
+			std::cout << "[info] decoder " << how << " " << want.ulWidth << "x" << want.ulHeight
+				<< " -> " << want.ulTargetWidth << "x" << want.ulTargetHeight
+				<< ", decode surfaces " << want.ulNumDecodeSurfaces << " of " << createinfo.ulNumDecodeSurfaces
+				<< ", output surfaces " << createinfo.ulNumOutputSurfaces
+				<< ", vram " << (vrambytes >> 10) << "KB" << std::endl;
+		}
+
+		/**
+		 * Description: decoder "want" is the current one, only surface counts may differ
+		 */
+		inline bool Unchanged(const CUVIDDECODECREATEINFO &want)
+		{
+			return DecoderCache::Fits(want, createinfo)
+				&& (want.ulWidth == createinfo.ulWidth)
+				&& (want.ulHeight == createinfo.ulHeight)
+				&& (want.ulTargetWidth == createinfo.ulTargetWidth)
+				&& (want.ulTargetHeight == createinfo.ulTargetHeight)
+				&& !memcmp(&want.display_area, &createinfo.display_area, sizeof(want.display_area))
+				&& !memcmp(&want.target_rect, &createinfo.target_rect, sizeof(want.target_rect));
+		}
+
+		/**
+		 * Description: reconfigure "decoder" created with "info" to the geometry of "want", "info"
+						follows on success. surface counts of "info" stay as the bound.
+		 */
+		inline int Reconfigure(CUvideodecoder decoder, const CUVIDDECODECREATEINFO &want, CUVIDDECODECREATEINFO &info)
+		{
+			CUVIDRECONFIGUREDECODERINFO reconfig;
+			memset(&reconfig, 0, sizeof(reconfig));
+			reconfig.ulWidth				= want.ulWidth;
+			reconfig.ulHeight				= want.ulHeight;
+			reconfig.ulTargetWidth			= want.ulTargetWidth;
+			reconfig.ulTargetHeight			= want.ulTargetHeight;
+			reconfig.ulNumDecodeSurfaces	= want.ulNumDecodeSurfaces;
+			reconfig.display_area.left		= want.display_area.left;
+			reconfig.display_area.top		= want.display_area.top;
+			reconfig.display_area.right		= want.display_area.right;
+			reconfig.display_area.bottom	= want.display_area.bottom;
+			reconfig.target_rect.left		= want.target_rect.left;
+			reconfig.target_rect.top		= want.target_rect.top;
+			reconfig.target_rect.right		= want.target_rect.right;
+			reconfig.target_rect.bottom		= want.target_rect.bottom;
+
+			cuvidCtxLock(cuCtxLock, 0);
+			int ret = cuvidReconfigureDecoder(decoder, &reconfig);
+			cuvidCtxUnlock(cuCtxLock, 0);
+
+			if (!ret)
+			{
+				info.ulWidth		= want.ulWidth;
+				info.ulHeight		= want.ulHeight;
+				info.ulTargetWidth	= want.ulTargetWidth;
+				info.ulTargetHeight	= want.ulTargetHeight;
+				info.display_area	= want.display_area;
+				info.target_rect	= want.target_rect;
+			}
+
+			return ret;
+		}
+
+		/**
+		 * Description: any surface of "decoder" handed off
+		 */
+		inline bool Handed(CUvideodecoder decoder)
+		{
+			boost::lock_guard<boost::mutex> lock(mapmtx);
+			return Mapped(decoder);
+		}
+
+		inline bool Mapped(CUvideodecoder decoder)
+		{
+			for (std::map<CUdeviceptr, CUvideodecoder>::iterator it = mapped.begin(); it != mapped.end(); it++)
+			{
+				if (it->second == decoder)
+					return true;
+			}
+
+			return false;
 		}
 
 	private:
@@ -538,6 +1446,34 @@ namespace NvCodec
 		 * Description: cuda objects
 		 */
 		int				dev;
+		cudaVideoCodec	codectype;	/* parser codec */
+		unsigned int	parsersurf;	/* decode surfaces parser is created with */
+		CUVIDDECODECREATEINFO	createinfo;	/* current decoder, surface counts and max size are its bound */
+		unsigned int	maxw;		/* coded width bound of reconfiguration, 0 first sequence size */
+		unsigned int	maxh;		/* coded height bound of reconfiguration, 0 first sequence size */
+		unsigned int	surfhead;	/* output surface headroom */
+		boost::atomic_uint64_t	vrambytes;	/* VRAM estimate of current decoder */
+
+		/**
+		 * Description: copies of decoded surfaces, surfaces are unmapped after their copies
+		 */
+		struct PendingUnmap
+		{
+			CUvideodecoder	decoder;	/* decoder mapped from */
+			CUdeviceptr		surf;		/* mapped surface */
+			cudaEvent_t		ev;			/* copy completion, NULL if complete */
+		};
+
+		CopyStream				copystream;	/* stream of frame copies and their events */
+		std::list<PendingUnmap>	unmapq;		/* surfaces being copied out, display thread only */
+
+		/**
+		 * Description: decoder scaler output options
+		 */
+		unsigned int	outw;		/* output width, 0 follows source */
+		unsigned int	outh;		/* output height, 0 follows source */
+		int				aspect;		/* AspectMode */
+		struct { int left, top, right, bottom; } croprect;	/* source crop, empty for display area */
 		static boost::mutex ctxcreatelock;		/* context handle */
 		CUcontext		cuCtx;		/* context handle */
 		CUvideoctxlock	cuCtxLock;	/* context lock */
@@ -554,7 +1490,11 @@ namespace NvCodec
 		 * Description: decoded frames list
 		 */
 		boost::recursive_mutex		qmtx;
+		boost::condition_variable_any	qcv;	/* queue room or surface unmapped notify */
 		unsigned int				qlen;		/* cached for decoded queue length */
+		unsigned int				qwaitms;	/* QSWait bound, millisecond, 0 unbounded */
+		boost::atomic_uint64_t		blockedus;	/* display callback blocked time, microsecond */
+		boost::atomic_uint64_t		qdropped;	/* pictures dropped by bounded wait */
 		std::list<CuFrame>			qpic;		/* cached for decoded nv12 data */
 		boost::atomic_bool			beof;		/* end of video frame */
 
@@ -565,7 +1505,17 @@ namespace NvCodec
 		HostPool	framepool;		/* RAM pool for frames */
 		bool		bLocalPool;
 		DevicePool	*devicepool;	/* VRAM pool for frames */
-		system_clock::time_point epoch;
+		system_clock::time_point epoch;	/* synthetic clock for input without timestamps */
+		PtsClock		ptsclock;		/* packet timestamp to wall clock */
+		boost::atomic_bool	ptsin;		/* packets carry timestamps */
+
+		/**
+		 * Description: zero-copy hand-off, mapped surfaces are frame buffers until PutFrame
+		 */
+		unsigned int							mapheld;	/* frames held downstream, 0 copies to devicepool */
+		boost::mutex							mapmtx;		/* lock for mapped and stale */
+		std::map<CUdeviceptr, CUvideodecoder>	mapped;		/* handed off surfaces, to their decoder */
+		std::list<CUvideodecoder>				stale;		/* replaced decoders with surfaces still mapped */
 	};
 	boost::mutex NvDecoder::ctxcreatelock;
 	// CUcontext __declspec(thread) NvDecoder::cuCtx = 0;
@@ -630,6 +1580,8 @@ namespace NvCodec
 			/**
 			 * Description: raw h264 file media source reader implementation
 			 */
+			ThreadPlacement::Instance().Pin(PSReader, node);
+
 			FILE *			p = NULL;
 			unsigned char * cachedata;	/* stream data cache buffer */
 			static const unsigned int cachelen = 1024;
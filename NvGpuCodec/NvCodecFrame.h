@@ -27,10 +27,12 @@ namespace NvCodec
 		unsigned char*		host_frame;	/* host frame buffer */
 		unsigned long long	timestamp;	/* timestamp */
 		bool				last;		/* last frame */
+		void*				ready;		/* cudaEvent_t completing the copy into dev_frame, NULL if complete */
 
-		CuFrame() : last(false) {}
-		CuFrame(void* _f) : last(false) { dev_frame = _f; host_frame = NULL; }
+		CuFrame() : last(false), ready(NULL) {}
+		CuFrame(void* _f) : last(false), ready(NULL) { dev_frame = _f; host_frame = NULL; }
 		CuFrame(unsigned int _w, unsigned int _h, unsigned int _pitch, void* _f, unsigned long long _t, bool _last = false)
+			: ready(NULL)
 		{
 			w = _w;
 			h = _h;
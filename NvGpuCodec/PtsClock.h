@@ -0,0 +1,88 @@
+#pragma once
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <chrono>
+
+/**
+ * Description: maps presentation timestamps of one stream to system_clock ticks. the first
+				timestamp is anchored to the wall clock when it is displayed, later ones keep
+				their media spacing. a slow correction follows frames arriving later than
+				predicted within "window" ms, so drift of a real-time source does not
+				accumulate. frames arriving early only give back earlier correction, input
+				decoded faster than real time keeps its media spacing. a timestamp going back
+				or jumping over "jump" ms re-anchors. output is strictly increasing.
+ */
+class PtsClock
+{
+public:
+	PtsClock(unsigned int rate = 10000000 /* timestamp units in Hz, parser default */, unsigned int window = 1000, unsigned int jump = 10000)
+		: tickspts((double)std::chrono::system_clock::period::den / std::chrono::system_clock::period::num / rate)
+		, drift((double)std::chrono::system_clock::period::den / std::chrono::system_clock::period::num * window / 1000)
+		, resync((long long)rate * jump / 1000)
+		, anchored(false), anchorpts(0), lastpts(0), anchorwall(0), offset(0), last(0)
+	{
+	}
+
+	/**
+	 * Description: system_clock ticks of "pts"
+	 */
+	unsigned long long Map(long long pts)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		long long now = std::chrono::system_clock::now().time_since_epoch().count();
+
+		if (!anchored || (pts < lastpts) || ((pts - lastpts) > resync))
+		{
+			anchored	= true;
+			anchorpts	= pts;
+			anchorwall	= now;
+			offset		= 0;
+		}
+		lastpts = pts;
+
+		double predict = anchorwall + (pts - anchorpts) * tickspts;
+
+		/**
+		 * Description: follow late arrival 1/64 per frame, slew bounded to 1 ms per frame.
+						early arrival is not followed beyond the anchor
+		 */
+		double err = (now - predict) - offset;
+		if ((err < drift) && (err > -drift) && ((err > 0) || (offset > 0)))
+		{
+			double step = err / 64, slew = drift / 1000;
+			offset += (step > slew) ? slew : ((step < -slew) ? -slew : step);
+			if (offset < 0)
+				offset = 0;
+		}
+
+		unsigned long long ts = (unsigned long long)(predict + offset);
+		if (ts <= last)
+			ts = last + 1;
+
+		return (last = ts);
+	}
+
+	/**
+	 * Description: forget the anchor, next timestamp anchors again
+	 */
+	void Reset()
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		anchored	= false;
+		offset		= 0;
+	}
+
+private:
+	double				tickspts;	/* system_clock ticks per timestamp unit */
+	double				drift;		/* correction window, system_clock ticks */
+	long long			resync;		/* forward jump re-anchoring, timestamp units */
+	bool				anchored;	/* anchor taken */
+	long long			anchorpts;	/* timestamp of anchor */
+	long long			lastpts;	/* latest timestamp */
+	long long			anchorwall;	/* wall clock of anchor, system_clock ticks */
+	double				offset;		/* drift correction, system_clock ticks */
+	unsigned long long	last;		/* latest output */
+	boost::mutex		mtx;		/* lock for clock */
+};
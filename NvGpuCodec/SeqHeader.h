@@ -0,0 +1,433 @@
+#pragma once
+
+#include <algorithm>
+#include <nvcuvid.h>
+
+/* decoded picture buffer bound of h264 and hevc, frames */
+const unsigned int DpbFramesMax = 16;
+
+/**
+ * Description: decoded picture buffer size of an h264/hevc stream from its sequence
+				parameter set in annex-b data. h264 takes max_dec_frame_buffering of vui,
+				or MaxDpbMbs of its level at its coded size, at least its reference frames.
+				hevc takes sps_max_dec_pic_buffering of the highest sub-layer, or MaxDpbSize
+				of its level at its coded size.
+ */
+class SeqHeader
+{
+public:
+	SeqHeader() : level(0), width(0), height(0), dpb(0) {}
+
+	/**
+	 * Description: parse the first complete sps of "codec" in "data", false if none found
+	 */
+	bool Parse(cudaVideoCodec codec, const unsigned char *data, unsigned int len)
+	{
+		bool hevc = (codec == cudaVideoCodec_HEVC);
+		if (!hevc && (codec != cudaVideoCodec_H264) && (codec != cudaVideoCodec_H264_SVC) && (codec != cudaVideoCodec_H264_MVC))
+			return false;
+
+		const unsigned char *end = data + len;
+		for (const unsigned char *nal = Next(data, end); nal < end;)
+		{
+			const unsigned char *next = Next(nal, end);
+
+			/* nal ends where the next start code begins */
+			const unsigned char *last = (next < end) ? (next - 3) : end;
+			Bits bits(nal, last);
+
+			if (hevc ? ((((*nal >> 1) & 0x3F) == 33) && Hevc(bits)) : (((*nal & 0x1F) == 7) && H264(bits)))
+				return true;
+
+			nal = next;
+		}
+
+		return false;
+	}
+
+	/**
+	 * Description: frames of decoded picture buffer, 0 before Parse succeeds
+	 */
+	inline unsigned int Dpb()
+	{
+		return dpb;
+	}
+
+	/**
+	 * Description: level_idc of h264, general_level_idc of hevc
+	 */
+	inline unsigned int Level()
+	{
+		return level;
+	}
+
+private:
+	/**
+	 * Description: rbsp bit reader skipping emulation prevention bytes
+	 */
+	class Bits
+	{
+	public:
+		Bits(const unsigned char *begin, const unsigned char *end) : p(begin), e(end), zeros(0), bit(0), over(false) {}
+
+		unsigned int U(unsigned int n)
+		{
+			unsigned int v = 0;
+			while (n--)
+				v = (v << 1) | Bit();
+			return v;
+		}
+
+		unsigned int UE()
+		{
+			unsigned int lz = 0;
+			while (!Bit())
+			{
+				if (over || (++lz > 31))
+				{
+					over = true;
+					return 0;
+				}
+			}
+
+			return ((1u << lz) - 1) + U(lz);
+		}
+
+		int SE()
+		{
+			unsigned int v = UE();
+			return (v & 1) ? (int)((v + 1) >> 1) : -(int)(v >> 1);
+		}
+
+		void Skip(unsigned int n)
+		{
+			while (n--)
+				Bit();
+		}
+
+		inline bool Over()
+		{
+			return over;
+		}
+
+	private:
+		unsigned int Bit()
+		{
+			if (p >= e)
+			{
+				over = true;
+				return 0;
+			}
+
+			unsigned int b = (*p >> (7 - bit)) & 1;
+			if (++bit == 8)
+			{
+				bit		= 0;
+				zeros	= *p ? 0 : (zeros + 1);
+				p++;
+
+				/* 00 00 03 */
+				if ((zeros >= 2) && (p < e) && (*p == 3))
+				{
+					p++;
+					zeros = 0;
+				}
+			}
+
+			return b;
+		}
+
+		const unsigned char *	p;		/* current byte */
+		const unsigned char *	e;		/* end of nal */
+		unsigned int			zeros;	/* zero bytes before p */
+		unsigned int			bit;	/* bit of current byte, msb first */
+		bool					over;	/* read past end */
+	};
+
+	/**
+	 * Description: first byte of the nal after the next start code, "end" if none
+	 */
+	static const unsigned char * Next(const unsigned char *p, const unsigned char *end)
+	{
+		for (; (p + 3) <= end; p++)
+		{
+			if (!p[0] && !p[1] && (p[2] == 1))
+				return p + 3;
+		}
+
+		return end;
+	}
+
+	static unsigned int MaxDpbMbs(unsigned int level)
+	{
+		switch (level)
+		{
+		case 9:
+		case 10:	return 396;
+		case 11:	return 900;
+		case 12:
+		case 13:
+		case 20:	return 2376;
+		case 21:	return 4752;
+		case 22:
+		case 30:	return 8100;
+		case 31:	return 18000;
+		case 32:	return 20480;
+		case 40:
+		case 41:	return 32768;
+		case 42:	return 34816;
+		case 50:	return 110400;
+		case 51:
+		case 52:	return 184320;
+		default:	return 696320;	/* level 6 and unknown */
+		}
+	}
+
+	static unsigned long long MaxLumaPs(unsigned int level)
+	{
+		switch (level)
+		{
+		case 30:	return 36864;
+		case 60:	return 122880;
+		case 63:	return 245760;
+		case 90:	return 552960;
+		case 93:	return 983040;
+		case 120:
+		case 123:	return 2228224;
+		case 150:
+		case 153:
+		case 156:	return 8912896;
+		default:	return 35651584;	/* level 6 and unknown */
+		}
+	}
+
+	static void ScalingList(Bits &bits, unsigned int size)
+	{
+		int lastscale = 8, nextscale = 8;
+		for (unsigned int j = 0; (j < size) && !bits.Over(); j++)
+		{
+			if (nextscale)
+				nextscale = (lastscale + bits.SE() + 256) % 256;
+			lastscale = nextscale ? nextscale : lastscale;
+		}
+	}
+
+	static void Hrd(Bits &bits)
+	{
+		unsigned int cpbcnt = bits.UE() + 1;
+		bits.Skip(8);
+		for (unsigned int i = 0; (i < cpbcnt) && !bits.Over(); i++)
+		{
+			bits.UE();
+			bits.UE();
+			bits.Skip(1);
+		}
+		bits.Skip(20);
+	}
+
+	bool H264(Bits &bits)
+	{
+		bits.Skip(8);	/* nal header */
+		unsigned int profile = bits.U(8);
+		bits.Skip(8);
+		unsigned int lvl = bits.U(8);
+		bits.UE();
+
+		switch (profile)
+		{
+		case 100: case 110: case 122: case 244: case 44: case 83:
+		case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+		{
+			unsigned int chroma = bits.UE();
+			if (chroma == 3)
+				bits.Skip(1);
+			bits.UE();
+			bits.UE();
+			bits.Skip(1);
+			if (bits.U(1))
+			{
+				for (unsigned int i = 0; i < ((chroma == 3) ? 12u : 8u); i++)
+				{
+					if (bits.U(1))
+						ScalingList(bits, (i < 6) ? 16 : 64);
+				}
+			}
+			break;
+		}
+		default:
+			break;
+		}
+
+		bits.UE();
+		unsigned int poctype = bits.UE();
+		if (poctype == 0)
+		{
+			bits.UE();
+		}
+		else if (poctype == 1)
+		{
+			bits.Skip(1);
+			bits.SE();
+			bits.SE();
+			unsigned int cycle = bits.UE();
+			for (unsigned int i = 0; (i < cycle) && !bits.Over(); i++)
+				bits.SE();
+		}
+
+		unsigned int refs = bits.UE();
+		bits.Skip(1);
+		unsigned int wmbs = bits.UE() + 1;
+		unsigned int hmbs = bits.UE() + 1;
+		if (!bits.U(1))
+		{
+			/* field coding, map units are field macroblock pairs */
+			hmbs *= 2;
+			bits.Skip(1);
+		}
+		bits.Skip(1);
+		if (bits.U(1))
+		{
+			bits.UE();
+			bits.UE();
+			bits.UE();
+			bits.UE();
+		}
+
+		if (bits.Over())
+			return false;
+
+		unsigned int frames = std::min(MaxDpbMbs(lvl) / (wmbs * hmbs), DpbFramesMax);
+
+		/**
+		 * Description: vui up to bitstream restriction
+		 */
+		if (bits.U(1))
+		{
+			if (bits.U(1) && (bits.U(8) == 255))
+				bits.Skip(32);
+			if (bits.U(1))
+				bits.Skip(1);
+			if (bits.U(1))
+			{
+				bits.Skip(4);
+				if (bits.U(1))
+					bits.Skip(24);
+			}
+			if (bits.U(1))
+			{
+				bits.UE();
+				bits.UE();
+			}
+			if (bits.U(1))
+				bits.Skip(65);
+
+			bool nalhrd = (bits.U(1) != 0);
+			if (nalhrd)
+				Hrd(bits);
+			bool vclhrd = (bits.U(1) != 0);
+			if (vclhrd)
+				Hrd(bits);
+			if (nalhrd || vclhrd)
+				bits.Skip(1);
+			bits.Skip(1);
+
+			if (bits.U(1))
+			{
+				bits.Skip(1);
+				bits.UE();
+				bits.UE();
+				bits.UE();
+				bits.UE();
+				bits.UE();
+				unsigned int buffering = bits.UE();
+				if (!bits.Over())
+					frames = std::min(buffering, DpbFramesMax);
+			}
+		}
+
+		level	= lvl;
+		width	= wmbs * 16;
+		height	= hmbs * 16;
+		dpb		= std::max(std::max(frames, std::min(refs, DpbFramesMax)), 1u);
+		return true;
+	}
+
+	bool Hevc(Bits &bits)
+	{
+		bits.Skip(16);	/* nal header */
+		bits.Skip(4);
+		unsigned int sublayers = bits.U(3);
+		bits.Skip(1);
+
+		/**
+		 * Description: profile_tier_level
+		 */
+		bits.Skip(88);
+		unsigned int lvl = bits.U(8);
+		unsigned int present[8] = { 0 };
+		for (unsigned int i = 0; i < sublayers; i++)
+			present[i] = bits.U(2);
+		if (sublayers)
+			bits.Skip(2 * (8 - sublayers));
+		for (unsigned int i = 0; i < sublayers; i++)
+		{
+			if (present[i] & 2)
+				bits.Skip(88);
+			if (present[i] & 1)
+				bits.Skip(8);
+		}
+
+		bits.UE();
+		if (bits.UE() == 3)
+			bits.Skip(1);
+		unsigned int w = bits.UE();
+		unsigned int h = bits.UE();
+		if (bits.U(1))
+		{
+			bits.UE();
+			bits.UE();
+			bits.UE();
+			bits.UE();
+		}
+		bits.UE();
+		bits.UE();
+		bits.UE();
+
+		unsigned int buffering = 0;
+		for (unsigned int i = (bits.U(1) ? 0 : sublayers); i <= sublayers; i++)
+		{
+			buffering = bits.UE() + 1;
+			bits.UE();
+			bits.UE();
+		}
+
+		if (bits.Over() || !w || !h)
+			return false;
+
+		/**
+		 * Description: MaxDpbSize of hevc spec A.4.2, bound of sps_max_dec_pic_buffering
+		 */
+		static const unsigned int MaxDpbPicBuf = 6;
+		unsigned long long ps = (unsigned long long)w * h, maxps = MaxLumaPs(lvl);
+		unsigned int frames = MaxDpbPicBuf;
+
+		if (ps <= (maxps >> 2))
+			frames = MaxDpbPicBuf * 4;
+		else if (ps <= (maxps >> 1))
+			frames = MaxDpbPicBuf * 2;
+		else if (ps <= ((maxps * 3) >> 2))
+			frames = (MaxDpbPicBuf * 4) / 3;
+
+		level	= lvl;
+		width	= w;
+		height	= h;
+		dpb		= std::max(std::min(buffering ? buffering : frames, DpbFramesMax), 1u);
+		return true;
+	}
+
+private:
+	unsigned int	level;	/* level of sps */
+	unsigned int	width;	/* coded width of sps */
+	unsigned int	height;	/* coded height of sps */
+	unsigned int	dpb;	/* frames of decoded picture buffer */
+};
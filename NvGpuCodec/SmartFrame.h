@@ -4,6 +4,8 @@
 
 #define PCC_FRAME_MAX_CHAN	4
 
+class FrameMeta;
+
 /**
 * Description:	Define the grid program supports image color space.
 */
@@ -43,6 +45,9 @@ class ISmartFrame
 {
 public:
 	virtual unsigned char*		NV12()					= 0;	/* get nv12 device data, non-contiguous */
+	virtual unsigned char*		Chroma()				= 0;	/* get nv12 interleaved uv plane, same step as luma */
+	virtual unsigned char*		Host()					= 0;	/* get nv12 host copy, step equals width, downloaded once on demand */
+	virtual const PCC_Frame*	Derive(PCC_ColorSpace cs, unsigned int w = 0, unsigned int h = 0) = 0;	/* get host copy in color space "cs" resized to w x h(0 keeps size), cached with frame */
 	virtual unsigned int		Width()					= 0;	/* get nv12 width */
 	virtual unsigned int		Height()				= 0;	/* get nv12 height */
 	virtual unsigned int		Step()					= 0;	/* get nv12 step */
@@ -54,6 +59,11 @@ public:
 
 	virtual unsigned int		GetRef()const 			= 0;	/* get reference count of smart frame, for debug */
 
+	virtual FrameMeta *			Meta()					= 0;	/* get inline metadata slots, see FrameMeta.h */
+	virtual ISmartFrame *		Parent()				= 0;	/* get frame a roi view looks into, NULL for full frame */
+	virtual void				Hold(const char *stage)	= 0;	/* mark stage holding the frame for residency report, "stage" must outlive the frame */
+	virtual void*				Ready()					= 0;	/* get cudaEvent_t completing device data, NULL if complete, wait on it from any stream before touching device data */
+
 	virtual ~ISmartFrame() {};
 protected:
 	friend void intrusive_ptr_add_ref(ISmartFrame * sf) { sf->add_ref(sf); }
@@ -77,4 +87,38 @@ typedef boost::intrusive_ptr<ISmartFrame> ISmartFramePtr;
 /**
  * Description: batch data callback function
  */
-typedef void(*FrameBatchRoutine)(ISmartFramePtr *p, unsigned int len, void * invoker);
\ No newline at end of file
+typedef void(*FrameBatchRoutine)(ISmartFramePtr *p, unsigned int len, void * invoker);
+
+/**
+ * Description: structure-of-arrays description of one batch, entry i describes p[i] of
+				the batch, entries of empty slots are zero. arrays live in pinned host
+				memory mapped to the device, "mapped" describes the same arrays by device
+				pointers for a kernel to read directly. arrays are reused by the next batch
+				of the delivering thread, they are valid until the callback returns, work
+				reading them must complete before it returns.
+ */
+struct FrameBatchDesc
+{
+	unsigned int			count;		/* entries of each array */
+	unsigned char **		luma;		/* nv12 luma device pointers */
+	unsigned char **		chroma;		/* nv12 interleaved uv device pointers */
+	unsigned int *			width;		/* widths in pixels */
+	unsigned int *			height;		/* heights in pixels */
+	unsigned int *			step;		/* pitches in bytes, shared by luma and chroma */
+	unsigned long long *	timestamp;	/* timestamps */
+	unsigned int *			tid;		/* stream ids */
+	unsigned int *			frameno;	/* frame sequence numbers */
+	void **					ready;		/* cudaEvent_t completing device data, NULL if complete, wait on it before reading */
+	const FrameBatchDesc *	mapped;		/* same arrays as device pointers, NULL if host memory could not be mapped */
+};
+
+/**
+ * Description: batch data callback function with descriptor
+ */
+typedef void(*FrameBatchDescRoutine)(ISmartFramePtr *p, const FrameBatchDesc &desc, void * invoker);
+
+/**
+ * Description: clip batch callback function, "p" holds "clips" clips of "length" frames,
+				frame t of clip c is p[c * length + t], oldest first
+ */
+typedef void(*ClipBatchRoutine)(ISmartFramePtr *p, unsigned int clips, unsigned int length, void * invoker);
\ No newline at end of file
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <cstring>
+
+using namespace std;
+
+#define LATENCY_BUCKETS		32	/* bucket i holds samples in [2^(i-1), 2^i) microseconds */
+
+/**
+ * Description: point in time copy of a latency histogram
+ */
+struct LatencySnapshot
+{
+	unsigned long long	count;						/* samples */
+	unsigned long long	sum;						/* sum of samples, microsecond */
+	unsigned long long	buckets[LATENCY_BUCKETS];	/* samples of each bucket */
+
+	LatencySnapshot() : count(0), sum(0) { memset(buckets, 0, sizeof(buckets)); }
+
+	inline unsigned long long Mean() const
+	{
+		return count ? (sum / count) : 0;
+	}
+
+	/**
+	 * Description: upper bound of the bucket holding percentile p(0~100), microsecond
+	 */
+	unsigned long long Percentile(double p) const
+	{
+		if (!count) return 0;
+
+		unsigned long long rank = (unsigned long long)(count * p / 100.0);
+		unsigned long long seen = 0;
+		for (int i = 0; i < LATENCY_BUCKETS; i++)
+		{
+			seen += buckets[i];
+			if (seen > rank) return (1ULL << i);
+		}
+		return (1ULL << (LATENCY_BUCKETS - 1));
+	}
+
+	/**
+	 * Description: samples between an earlier snapshot and this one
+	 */
+	LatencySnapshot Since(const LatencySnapshot &prev) const
+	{
+		LatencySnapshot d;
+		d.count = count - prev.count;
+		d.sum	= sum - prev.sum;
+		for (int i = 0; i < LATENCY_BUCKETS; i++)
+			d.buckets[i] = buckets[i] - prev.buckets[i];
+		return d;
+	}
+};
+
+/**
+ * Description: lock-free log2 bucketed latency histogram, Record is a few relaxed atomic adds
+ */
+class LatencyHistogram
+{
+public:
+	LatencyHistogram() : count(0), sum(0)
+	{
+		for (int i = 0; i < LATENCY_BUCKETS; i++)
+			buckets[i] = 0;
+	}
+
+	inline void Record(unsigned long long us)
+	{
+		buckets[Bucket(us)].fetch_add(1, boost::memory_order_relaxed);
+		sum.fetch_add(us, boost::memory_order_relaxed);
+		count.fetch_add(1, boost::memory_order_relaxed);
+	}
+
+	LatencySnapshot Snapshot() const
+	{
+		LatencySnapshot s;
+		s.count = count.load(boost::memory_order_relaxed);
+		s.sum	= sum.load(boost::memory_order_relaxed);
+		for (int i = 0; i < LATENCY_BUCKETS; i++)
+			s.buckets[i] = buckets[i].load(boost::memory_order_relaxed);
+		return s;
+	}
+
+private:
+	static inline unsigned int Bucket(unsigned long long us)
+	{
+		if (!us) return 0;
+#if defined(__GNUC__)
+		unsigned int b = 64 - __builtin_clzll(us);
+#else
+		unsigned int b = 0;
+		while (us) { us >>= 1; b++; }
+#endif
+		return (b < LATENCY_BUCKETS) ? b : (LATENCY_BUCKETS - 1);
+	}
+
+	boost::atomic_uint64_t	buckets[LATENCY_BUCKETS];
+	boost::atomic_uint64_t	count;
+	boost::atomic_uint64_t	sum;
+};
+
+/**
+ * Description: steady clock in microsecond, used for latency stamps
+ */
+inline unsigned long long MetricsClock()
+{
+	return boost::chrono::duration_cast<boost::chrono::microseconds>(
+		boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Description: point in time copy of one stage(or hop)
+ */
+struct StageSnapshot
+{
+	LatencySnapshot		wait;		/* queue wait time */
+	LatencySnapshot		service;	/* service time */
+	unsigned long long	frames;		/* frames processed */
+	unsigned long long	batches;	/* batches processed */
+	unsigned long long	clock;		/* snapshot time, microsecond */
+
+	/**
+	 * Description: frames per second between an earlier snapshot and this one
+	 */
+	inline double Fps(const StageSnapshot &prev) const
+	{
+		return (clock > prev.clock) ? ((frames - prev.frames) * 1000000.0 / (clock - prev.clock)) : 0;
+	}
+
+	inline double Bps(const StageSnapshot &prev) const
+	{
+		return (clock > prev.clock) ? ((batches - prev.batches) * 1000000.0 / (clock - prev.clock)) : 0;
+	}
+};
+
+/**
+ * Description: latency and throughput counters of one stage
+ */
+class StageMetrics
+{
+public:
+	StageMetrics() : frames(0), batches(0) {}
+
+	inline void Wait(unsigned long long us)		{ wait.Record(us); }
+	inline void Service(unsigned long long us)	{ service.Record(us); }
+	inline void Frames(unsigned int n = 1)		{ frames.fetch_add(n, boost::memory_order_relaxed); }
+	inline void Batches(unsigned int n = 1)		{ batches.fetch_add(n, boost::memory_order_relaxed); }
+
+	StageSnapshot Snapshot() const
+	{
+		StageSnapshot s;
+		s.wait		= wait.Snapshot();
+		s.service	= service.Snapshot();
+		s.frames	= frames.load(boost::memory_order_relaxed);
+		s.batches	= batches.load(boost::memory_order_relaxed);
+		s.clock		= MetricsClock();
+		return s;
+	}
+
+private:
+	LatencyHistogram		wait;		/* queue wait time */
+	LatencyHistogram		service;	/* service time */
+	boost::atomic_uint64_t	frames;		/* frames counter */
+	boost::atomic_uint64_t	batches;	/* batches counter */
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/assert.hpp>
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * Description: stage worker scaling policy. backlog of a stage is estimated as
+				depth * service_time / active_workers, a stage scales up when backlog
+				stays above up_backlog for "hysteresis" ticks, and parks a worker when
+				backlog stays under down_backlog for "hysteresis" ticks.
+ */
+struct ScalePolicy
+{
+	unsigned int	minworker;		/* lower bound of active workers per stage */
+	unsigned int	maxworker;		/* upper bound of active workers per stage */
+	unsigned int	interval;		/* controller tick, millisecond */
+	unsigned int	up_backlog;		/* scale up threshold, millisecond */
+	unsigned int	down_backlog;	/* scale down threshold, millisecond */
+	unsigned int	hysteresis;		/* consecutive ticks before a decision */
+
+	ScalePolicy(unsigned int _min = 1, unsigned int _max = 4)
+		: minworker(_min), maxworker(_max), interval(100), up_backlog(100), down_backlog(20), hysteresis(3)
+	{
+	}
+};
+
+/**
+ * Description: scaling metrics of one stage
+ */
+struct ScaleMetrics
+{
+	unsigned int		active;		/* active workers */
+	unsigned int		depth;		/* queue depth at last tick */
+	unsigned int		service;	/* mean service time of last tick, microsecond */
+	unsigned long long	scaleups;	/* scale up decisions */
+	unsigned long long	scaledowns;	/* scale down decisions */
+};
+
+/**
+ * Description: queue depth driven worker controller, it only decides how many workers
+				of each stage should be active, parking and waking is up to the owner.
+ */
+class StageScaler
+{
+public:
+	StageScaler(unsigned int stages, const ScalePolicy &p) : stagecnt(stages), policy(p)
+	{
+		BOOST_ASSERT(stages > 0);
+		BOOST_ASSERT(p.minworker > 0);
+		BOOST_ASSERT(p.maxworker >= p.minworker);
+
+		stage = new StageState[stagecnt];
+		for (int i = 0; i < stagecnt; i++)
+			stage[i].active = policy.minworker;
+	}
+
+	~StageScaler()
+	{
+		delete[] stage;
+		stage = NULL;
+	}
+
+	/**
+	 * Description: evaluate one stage with its queue depth and mean service time(microsecond)
+					of the last tick, return active worker count after decision
+	 */
+	unsigned int Tick(unsigned int s, unsigned int depth, unsigned int service)
+	{
+		StageState &st = stage[s];
+		st.depth = depth;
+
+		/* no frame served during last tick, keep previous estimation */
+		if (service)
+			st.service = service;
+
+		unsigned int active = st.active;
+		unsigned long long backlog = ((unsigned long long)depth * st.service) / (active * 1000);
+
+		if ((backlog > policy.up_backlog) && (active < policy.maxworker))
+		{
+			st.downticks = 0;
+			if (++st.upticks >= policy.hysteresis)
+			{
+				st.upticks = 0;
+				st.active = ++active;
+				st.scaleups++;
+
+				std::cout << "[info] stage " << s << " scale up to " << active << " workers, depth "
+					<< depth << ", service " << st.service << "us" << std::endl;
+			}
+		}
+		else if ((backlog < policy.down_backlog) && (active > policy.minworker))
+		{
+			st.upticks = 0;
+			if (++st.downticks >= policy.hysteresis)
+			{
+				st.downticks = 0;
+				st.active = --active;
+				st.scaledowns++;
+
+				std::cout << "[info] stage " << s << " scale down to " << active << " workers, depth "
+					<< depth << ", service " << st.service << "us" << std::endl;
+			}
+		}
+		else
+		{
+			st.upticks = st.downticks = 0;
+		}
+
+		return active;
+	}
+
+	inline unsigned int Active(unsigned int s)
+	{
+		return stage[s].active;
+	}
+
+	inline ScaleMetrics Metrics(unsigned int s)
+	{
+		ScaleMetrics m;
+		m.active		= stage[s].active;
+		m.depth			= stage[s].depth;
+		m.service		= stage[s].service;
+		m.scaleups		= stage[s].scaleups;
+		m.scaledowns	= stage[s].scaledowns;
+		return m;
+	}
+
+	inline const ScalePolicy & Policy()
+	{
+		return policy;
+	}
+
+private:
+	struct StageState
+	{
+		boost::atomic_uint32_t	active;		/* active workers */
+		boost::atomic_uint32_t	depth;		/* queue depth */
+		boost::atomic_uint32_t	service;	/* service time estimation */
+		boost::atomic_uint64_t	scaleups;
+		boost::atomic_uint64_t	scaledowns;
+		unsigned int			upticks;	/* consecutive ticks over threshold, controller only */
+		unsigned int			downticks;	/* consecutive ticks under threshold, controller only */
+
+		StageState() : active(1), depth(0), service(0), scaleups(0), scaledowns(0), upticks(0), downticks(0) {}
+	};
+
+	unsigned int	stagecnt;	/* stage count */
+	ScalePolicy		policy;		/* scaling policy */
+	StageState *	stage;		/* state of each stage */
+};
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/atomic.hpp>
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
+#include <vector>
+#include <map>
+
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+/**
+ * Description: thread kinds which can be placed, pipeline procedure i uses PSPipeline + i
+ */
+enum PlacementStage
+{
+	PSReader = 0,	/* media source reader thread */
+	PSDecoder = 1,	/* FrameBatchPipe worker thread, owns decoder output */
+	PSPipeline = 2,	/* BatchPipeline procedure threads */
+};
+
+/**
+ * Description: NUMA aware thread placement. each stream is assigned a node round robin,
+				its reader and decoder worker are pinned to cores of that node, host
+				buffers allocated by those threads are first touched on the same node.
+				an optional core list per stage narrows the cores used by that stage.
+				placement is enabled by default only on multi-node machines.
+ */
+class ThreadPlacement
+{
+public:
+	static ThreadPlacement & Instance()
+	{
+		static ThreadPlacement placement;
+		return placement;
+	}
+
+	/**
+	 * Description: enable or disable pinning, core lists are kept
+	 */
+	inline void Enable(bool enable)
+	{
+		enabled = enable;
+	}
+
+	/**
+	 * Description: restrict "stage" threads to "cores", empty list removes restriction
+	 */
+	void Cores(unsigned int stage, const std::vector<int> &cores)
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		stagecores[stage] = cores;
+	}
+
+	inline unsigned int Nodes()
+	{
+		return nodecores.size();
+	}
+
+	/**
+	 * Description: assign a node for a new stream
+	 */
+	inline int NextNode()
+	{
+		return (int)(streamidx++ % nodecores.size());
+	}
+
+	/**
+	 * Description: pin calling thread. node < 0 only applies the stage core list,
+					otherwise cores of node intersect with the stage core list.
+	 */
+	bool Pin(unsigned int stage, int node)
+	{
+		std::vector<int> cores;
+		{
+			boost::lock_guard<boost::mutex> lock(mtx);
+			std::map<unsigned int, std::vector<int> >::iterator it = stagecores.find(stage);
+
+			if ((node >= 0) && enabled)
+			{
+				const std::vector<int> &nc = nodecores[node % nodecores.size()];
+				for (int i = 0; i < nc.size(); i++)
+				{
+					if ((it == stagecores.end()) || it->second.empty() ||
+						(std::find(it->second.begin(), it->second.end(), nc[i]) != it->second.end()))
+						cores.push_back(nc[i]);
+				}
+
+				/* stage core list is on other nodes, follow the core list */
+				if (cores.empty() && (it != stagecores.end()))
+					cores = it->second;
+			}
+			else if (it != stagecores.end())
+			{
+				cores = it->second;
+			}
+		}
+
+		CurrentNode() = node;
+
+		if (cores.empty())
+			return false;
+
+		return SetAffinity(cores);
+	}
+
+	/**
+	 * Description: node assigned to calling thread, -1 if not placed
+	 */
+	static inline int & CurrentNode()
+	{
+		return curnode;
+	}
+
+	/**
+	 * Description: print topology and stage core lists
+	 */
+	void Report()
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+
+		std::cout << "[info] thread placement " << (enabled ? "enabled" : "disabled")
+			<< ", " << nodecores.size() << " numa node(s)" << std::endl;
+
+		for (int i = 0; i < nodecores.size(); i++)
+			std::cout << "[info]   node " << i << " cores " << CoreList(nodecores[i]) << std::endl;
+
+		for (std::map<unsigned int, std::vector<int> >::iterator it = stagecores.begin(); it != stagecores.end(); it++)
+			std::cout << "[info]   stage " << it->first << " cores " << CoreList(it->second) << std::endl;
+	}
+
+private:
+	ThreadPlacement() : streamidx(0), enabled(false)
+	{
+		Probe();
+
+		/* pinning only pays off across sockets */
+		enabled = (nodecores.size() > 1);
+	}
+
+	void Probe()
+	{
+#ifdef WIN32
+		ULONG highest = 0;
+		if (GetNumaHighestNodeNumber(&highest))
+		{
+			for (ULONG n = 0; n <= highest; n++)
+			{
+				ULONGLONG mask = 0;
+				std::vector<int> cores;
+				if (GetNumaNodeProcessorMask((UCHAR)n, &mask))
+				{
+					for (int c = 0; c < 64; c++)
+						if (mask & (1ULL << c)) cores.push_back(c);
+				}
+
+				if (cores.size())
+					nodecores.push_back(cores);
+			}
+		}
+#else
+		for (int n = 0; ; n++)
+		{
+			char path[128] = { 0 };
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+
+			FILE *p = fopen(path, "r");
+			if (!p) break;
+
+			char line[1024] = { 0 };
+			if (fgets(line, sizeof(line), p))
+			{
+				std::vector<int> cores = ParseCoreList(line);
+				if (cores.size())
+					nodecores.push_back(cores);
+			}
+			fclose(p);
+		}
+#endif
+
+		if (nodecores.empty())
+		{
+			/**
+			 * Description: no numa information, treat as one node
+			 */
+			std::vector<int> cores;
+			for (int c = 0; c < max(boost::thread::hardware_concurrency(), 1u); c++)
+				cores.push_back(c);
+
+			nodecores.push_back(cores);
+		}
+	}
+
+	/**
+	 * Description: parse linux cpulist format, e.g. "0-3,8-11"
+	 */
+	static std::vector<int> ParseCoreList(const char *line)
+	{
+		std::vector<int> cores;
+		const char *p = line;
+
+		while (*p)
+		{
+			int first = 0, last = 0, n = 0;
+			if (sscanf(p, "%d-%d%n", &first, &last, &n) == 2)
+			{
+				for (int c = first; c <= last; c++) cores.push_back(c);
+			}
+			else if (sscanf(p, "%d%n", &first, &n) == 1)
+			{
+				cores.push_back(first);
+			}
+			else
+			{
+				break;
+			}
+
+			p += n;
+			if (*p != ',') break;
+			p++;
+		}
+
+		return cores;
+	}
+
+	static std::string CoreList(const std::vector<int> &cores)
+	{
+		std::ostringstream os;
+		for (int i = 0; i < cores.size(); i++)
+			os << (i ? "," : "") << cores[i];
+		return os.str();
+	}
+
+	static bool SetAffinity(const std::vector<int> &cores)
+	{
+#ifdef WIN32
+		DWORD_PTR mask = 0;
+		for (int i = 0; i < cores.size(); i++)
+			if (cores[i] < (int)(sizeof(DWORD_PTR) << 3)) mask |= ((DWORD_PTR)1 << cores[i]);
+
+		return mask && SetThreadAffinityMask(GetCurrentThread(), mask);
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int i = 0; i < cores.size(); i++)
+			if (cores[i] < CPU_SETSIZE) CPU_SET(cores[i], &set);
+
+		return (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+#endif
+	}
+
+private:
+	boost::mutex									mtx;		/* lock for core lists */
+	std::vector<std::vector<int> >					nodecores;	/* cores of each numa node */
+	std::map<unsigned int, std::vector<int> >		stagecores;	/* optional core list of each stage */
+	boost::atomic_uint32_t							streamidx;	/* streams placed */
+	boost::atomic_bool								enabled;	/* node pinning switch */
+
+#if (__cplusplus >= 201103L)
+	static thread_local int							curnode;	/* node of current thread */
+#else
+	static __declspec(thread) int					curnode;	/* node of current thread */
+#endif
+};
+
+#if (__cplusplus >= 201103L)
+thread_local int ThreadPlacement::curnode(-1);
+#else
+int __declspec(thread) ThreadPlacement::curnode(-1);
+#endif